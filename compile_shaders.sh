@@ -1,5 +1,7 @@
 #!/bin/bash
 
 rm shaders/*.spv
-glslc shaders/raytracer.comp -o shaders/raytracer.comp.spv
-
+for shader in shaders/*.comp; do
+    glslc --target-env=vulkan1.1 "$shader" -o "$shader.spv"
+done
+glslc --target-env=vulkan1.2 -DRAY_QUERY shaders/raytracer.comp -o shaders/raytracer_ray_query.comp.spv
@@ -0,0 +1,228 @@
+// Declarations shared by every compute pass: camera, push constants and per pixel buffers
+// Must match the structs in main.cpp
+
+// Bits of pc.features
+#define FEATURE_DENOISER        1u
+#define FEATURE_CAMERA_MOVED    2u
+#define FEATURE_RESTIR          4u
+#define FEATURE_GUIDING         8u
+#define FEATURE_RESIZED         16u     // The render resolution changed, last frame buffers can not be reprojected
+#define FEATURE_RADIANCE_CACHE  32u
+#define FEATURE_PHOTONS         64u
+
+// ------------ Struct definitions --------------
+struct Camera{
+    mat4 view;
+    mat4 viewInv;
+    mat4 proj;
+    mat4 projInv;
+    mat4 viewproj;
+    mat4 prevViewproj;      // View projection of the previous frame, used to reproject history
+    vec3 position;
+    float tanHalfFOV;
+};
+
+// Primary hit of a pixel
+struct GBufferTexel{
+    vec4 normal_depth;      // World normal. Alpha is the distance from the camera, 0.0 if nothing was hit
+    vec4 albedo_mat;        // Albedo of the surface. Alpha is the material index, -1.0 if nothing was hit
+};
+
+// Denoiser temporal history of a pixel
+struct DenoiserHistory{
+    vec4 color;             // Demodulated color. Alpha is the number of frames accumulated
+    vec4 moments;           // First and second luminance moments
+};
+
+
+// ReSTIR reservoir holding one light sample of a pixel
+struct Reservoir{
+    vec4 sample_point;      // Point on the light (w = 1.0 + triangle for mesh lights, 1.0 for the rest)
+                            // or direction to it for lights at infinity (w = 0.0)
+    int light;              // Light index of the sample, -1 if empty
+    float w_sum;            // Sum of the resampling weights seen
+    float M;                // Number of candidates seen
+    float W;                // Unbiased contribution weight of the sample
+};
+
+
+// ------------ External memory layout --------------
+layout(push_constant) uniform PushConstants {
+    float time;
+    uint frameCount;
+    int total_lights;
+    float lights_strength_sum;
+    vec3 world_up;
+    bool reset_frame_accumulation;
+    int total_spheres;
+    int total_triangles;
+    int total_meshes;
+    int light_samples;
+    uint features;          // FEATURE_* bits
+    uint frame_index;       // Never resets, its parity selects the ping-pong half of the per pixel buffers
+    int denoiser_step;      // A-trous iteration being run
+    int denoiser_iterations;
+    int environment_light;  // Index of the environment map light, -1 if the sky is procedural
+    int render_width;       // Resolution traced this frame, the top left corner of outputImage
+    int render_height;
+    int photons_per_frame;
+    uint photon_iteration;  // Frames the caustic photon map has been refined for, shrinks the gather radius
+    int total_parallelograms;
+    int total_disks;
+    int total_boxes;
+    int total_planes;
+    int total_primitives;   // Entries of the primitive stream
+} pc;
+
+layout(set = 0, binding = 0) uniform UniformBufferObject {
+    Camera camera;
+    vec4 sceneMin;          // Bounds of the scene geometry
+    vec4 sceneMax;
+} ubo;
+
+// Allocated at the swapchain resolution, only the render_size() corner is written when rendering at a lower scale
+layout(set = 1, binding = 0, rgba8) uniform image2D outputImage;
+
+// Two halves, current and previous frame. Holds the running average in linear space
+layout(set = 2, std430, binding = 0) buffer ColorAccumulationSSBOInOut {
+    vec4 accumulated_colors[];
+};
+
+// Two halves, current and previous frame
+layout(set = 2, std430, binding = 1) buffer SampleCountSSBOInOut {
+    int sample_counts[];
+};
+
+// Two halves, current and previous frame
+layout(set = 2, std430, binding = 2) buffer GBufferSSBOInOut {
+    GBufferTexel gbuffer[];
+};
+
+// Linear color traced this frame, before accumulation
+layout(set = 2, std430, binding = 3) buffer FrameColorSSBOInOut {
+    vec4 frame_colors[];
+};
+
+// Two halves, current and previous frame
+layout(set = 2, std430, binding = 4) buffer DenoiserHistorySSBOInOut {
+    DenoiserHistory denoiser_history[];
+};
+
+// Two halves ping-ponged by the a-trous iterations. Alpha is the variance
+layout(set = 2, std430, binding = 5) buffer DenoiserFilterSSBOInOut {
+    vec4 denoiser_filter[];
+};
+
+
+// Three regions: this frame before spatial reuse, then final reservoirs of the current and previous frame
+layout(set = 2, std430, binding = 6) buffer ReservoirSSBOInOut {
+    Reservoir reservoirs[];
+};
+
+// Swapchain resolution pixels packed as unorm8, copied to the swapchain when the render scale is below 1
+layout(set = 2, std430, binding = 7) buffer DisplaySSBOOut {
+    uint display_pixels[];
+};
+
+// Swapchain resolution pixels packed as unorm8, output of the EASU pass that RCAS sharpens
+layout(set = 2, std430, binding = 8) buffer UpscaleSSBOInOut {
+    uint upscale_pixels[];
+};
+
+
+// ------------ Pixel helpers --------------
+bool feature_on(uint feature){
+    return (pc.features & feature) != 0u;
+}
+
+// Resolution of the per pixel buffers this frame, smaller than outputImage when the render scale is below 1
+ivec2 render_size(){
+    return ivec2(pc.render_width, pc.render_height);
+}
+
+// Offset of the current and previous frame halves of the ping-pong buffers
+uint current_half(ivec2 size){
+    return (pc.frame_index & 1u) * uint(size.x * size.y);
+}
+
+uint previous_half(ivec2 size){
+    return ((pc.frame_index + 1u) & 1u) * uint(size.x * size.y);
+}
+
+uint pixel_index(ivec2 pixel, ivec2 size){
+    return uint(pixel.y * size.x + pixel.x);
+}
+
+// Direction of the camera ray through a point of the image, in world space
+vec3 camera_ray_dir(vec2 pixel, ivec2 size){
+    float aspect = float(size.x)/float(size.y);
+    float ndcX = 2.0 * pixel.x / size.x - 1.0;
+    float ndcY = 1.0 - 2.0 * pixel.y / size.y;
+
+    vec3 dir_camera_space = normalize(vec3(
+        ndcX * aspect * ubo.camera.tanHalfFOV,
+        ndcY * ubo.camera.tanHalfFOV,
+        -1.0
+    ));
+
+    return normalize(vec3(ubo.camera.viewInv * vec4(dir_camera_space, 0.0)));
+}
+
+// Projects a world position (w = 1.0) or direction (w = 0.0) with the previous frame camera
+// Returns false if it falls outside the image
+bool reproject(vec4 world_pos, ivec2 size, out vec2 prev_pixel){
+    vec4 clip = ubo.camera.prevViewproj * world_pos;
+    if(clip.w <= 0.0) return false;
+    vec2 ndc = clip.xy / clip.w;
+    prev_pixel = vec2((ndc.x + 1.0) * 0.5 * size.x, (1.0 - ndc.y) * 0.5 * size.y);
+    return prev_pixel.x >= 0.0 && prev_pixel.y >= 0.0 && prev_pixel.x < size.x && prev_pixel.y < size.y;
+}
+
+// False if the previous texel belongs to another surface (disocclusion)
+bool gbuffer_consistent(GBufferTexel cur, GBufferTexel prev){
+    if(prev.albedo_mat.w != cur.albedo_mat.w) return false;
+    if(cur.albedo_mat.w < 0.0) return true;
+    if(abs(prev.normal_depth.w - cur.normal_depth.w) > 0.1 * cur.normal_depth.w) return false;
+    return dot(prev.normal_depth.xyz, cur.normal_depth.xyz) > 0.9;
+}
+
+// Finds where the primary hit of pixel was seen last frame
+// Fills the bilinear taps around it that are the same surface, returns the sum of their weights
+float reproject_taps(ivec2 pixel, ivec2 size, out uint taps[4], out float weights[4]){
+    GBufferTexel cur = gbuffer[current_half(size) + pixel_index(pixel, size)];
+    float weight_sum = 0.0;
+    for(int i = 0; i < 4; i++){
+        taps[i] = 0u;
+        weights[i] = 0.0;
+    }
+    if(feature_on(FEATURE_RESIZED)) return 0.0;
+
+    // The sky is reprojected as a direction, it is infinitely far away
+    vec2 prev_pixel;
+    vec3 dir = camera_ray_dir(vec2(pixel) + 0.5, size);
+    vec4 world_pos = cur.albedo_mat.w < 0.0 ? vec4(dir, 0.0) : vec4(ubo.camera.position + dir * cur.normal_depth.w, 1.0);
+    if(!reproject(world_pos, size, prev_pixel)) return 0.0;
+
+    vec2 p = prev_pixel - 0.5;
+    ivec2 base = ivec2(floor(p));
+    vec2 f = fract(p);
+    float bilinear[4] = float[4]((1.0-f.x)*(1.0-f.y), f.x*(1.0-f.y), (1.0-f.x)*f.y, f.x*f.y);
+
+    for(int i = 0; i < 4; i++){
+        ivec2 tap = base + ivec2(i & 1, i >> 1);
+        if(tap.x < 0 || tap.y < 0 || tap.x >= size.x || tap.y >= size.y) continue;
+
+        uint tap_idx = pixel_index(tap, size);
+        if(!gbuffer_consistent(cur, gbuffer[previous_half(size) + tap_idx])) continue;
+
+        taps[i] = tap_idx;
+        weights[i] = bilinear[i];
+        weight_sum += bilinear[i];
+    }
+
+    return weight_sum;
+}
+
+float luminance(vec3 c){
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
@@ -0,0 +1,51 @@
+// Path guiding: a uniform grid over the scene bounds with a full directional quadtree per cell
+// Directions are mapped to the unit square with the cylindrical equal-area mapping,
+// the quadtree leaves hold the incident radiance learned by previous frames
+// Must match the guiding constants in main.cpp
+
+const int guiding_grid = 16;                // Cells per axis
+const int guiding_depth = 3;                // Quadtree levels below the root
+const int guiding_leaves_side = 8;          // 2^guiding_depth
+const int guiding_leaves = 64;              // Leaves per cell
+const int guiding_nodes = 85;               // Nodes per cell, 1 + 4 + 16 + 64
+const float guiding_train_scale = 16.0;     // Fixed point scale of the training atomics
+const float guiding_train_clamp = 64.0;     // Largest radiance / pdf splatted by one sample
+
+// Radiance / pdf splatted by the trace pass, fixed point so it can use integer atomics
+layout(set = 1, std430, binding = 9) buffer GuidingTrainSSBOInOut {
+    uint guiding_train[];
+};
+
+// Quadtree of every cell stored level after level, each node holds the sum of its leaves
+layout(set = 1, std430, binding = 10) buffer GuidingTreeSSBOInOut {
+    float guiding_tree[];
+};
+
+int guiding_level_offset(int level){
+    // 1 + 4 + ... + 4^(level-1)
+    return ((1 << (2*level)) - 1) / 3;
+}
+
+int guiding_cell(vec3 p){
+    vec3 extent = max(ubo.sceneMax.xyz - ubo.sceneMin.xyz, vec3(0.0001));
+    ivec3 c = clamp(ivec3((p - ubo.sceneMin.xyz) / extent * guiding_grid), ivec3(0), ivec3(guiding_grid - 1));
+    return (c.z * guiding_grid + c.y) * guiding_grid + c.x;
+}
+
+vec2 guiding_dir_to_square(vec3 d){
+    float phi = atan(d.y, d.x);
+    if(phi < 0.0) phi += 2.0 * 3.14159265359;
+    return vec2(clamp((d.z + 1.0) * 0.5, 0.0, 0.99999), min(phi / (2.0 * 3.14159265359), 0.99999));
+}
+
+vec3 guiding_square_to_dir(vec2 s){
+    float cos_theta = 2.0 * s.x - 1.0;
+    float sin_theta = sqrt(max(0.0, 1.0 - cos_theta*cos_theta));
+    float phi = 2.0 * 3.14159265359 * s.y;
+    return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+int guiding_leaf(vec2 s){
+    ivec2 l = ivec2(s * guiding_leaves_side);
+    return l.y * guiding_leaves_side + l.x;
+}
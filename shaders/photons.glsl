@@ -0,0 +1,38 @@
+// Caustic photon map: photons that went through at least one specular vertex, stored where they land
+// on a non-specular surface. The map is a hash grid of linked lists rebuilt every frame
+// Must match the photon constants in main.cpp
+
+const float photon_radius = 0.005;      // Initial gather radius, fraction of the scene bounds diagonal. Also the grid cell size
+const float photon_alpha = 0.7;         // Progressive radius reduction, the squared radius shrinks as iteration^(alpha-1)
+
+struct Photon{
+    vec4 position;
+    vec4 power;             // Flux carried, already divided by the photons emitted this frame
+    vec4 direction;         // Travel direction when it landed
+    uint next;              // Next photon of the same grid bucket plus one, 0 ends the list
+};
+
+// Holds pc.photons_per_frame photons
+layout(set = 1, std430, binding = 14) buffer PhotonsSSBOInOut {
+    Photon photons[];
+};
+
+// Head of the list of every hashed grid bucket plus one, 0 if it is empty
+layout(set = 1, std430, binding = 15) buffer PhotonGridSSBOInOut {
+    uint photon_count;
+    uint photon_heads[];
+};
+
+float photon_cell_size(){
+    return photon_radius * length(ubo.sceneMax.xyz - ubo.sceneMin.xyz);
+}
+
+ivec3 photon_cell(vec3 p){
+    return ivec3(floor((p - ubo.sceneMin.xyz) / photon_cell_size()));
+}
+
+uint photon_bucket(ivec3 c){
+    // Spatial hash with large primes, collisions are filtered by distance when gathering
+    uint h = uint(c.x) * 73856093u ^ uint(c.y) * 19349663u ^ uint(c.z) * 83492791u;
+    return h % uint(photon_heads.length());
+}
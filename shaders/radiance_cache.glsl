@@ -0,0 +1,24 @@
+// World space radiance cache: an open addressing hash table of outgoing radiance
+// Entries are keyed by a quantized position and the dominant axis of the normal
+// The trace pass splats path samples into the accumulators, radiance_cache_update.comp resolves them
+// Must match the radiance cache constants in main.cpp
+
+const float radiance_cache_scale = 256.0;       // Fixed point scale of the accumulation atomics
+const float radiance_cache_clamp = 64.0;        // Largest radiance splatted by one sample
+const uint radiance_cache_max_age = 120u;       // Frames without use after which an entry is evicted
+const float radiance_cache_max_samples = 256.0; // Samples after which the entry becomes a moving average
+
+struct RadianceCacheEntry{
+    uint key;               // 0 if the slot is empty
+    uint last_used;         // pc.frame_index of the last lookup, the least recently used entry is replaced first
+    uint accum_r;           // Radiance splatted this frame, fixed point
+    uint accum_g;
+    uint accum_b;
+    uint accum_count;
+    vec4 radiance;          // Resolved outgoing radiance. Alpha is the number of samples it averages
+};
+
+// Its length is the configured number of entries
+layout(set = 1, std430, binding = 13) buffer RadianceCacheSSBOInOut {
+    RadianceCacheEntry radiance_cache[];
+};
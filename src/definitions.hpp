@@ -12,6 +12,20 @@ enum LightTypes{
     CONE = 4,
     AREA = 5,
     TRIANGLE = 6,
+    ENVIRONMENT = 7,
+    MESH = 8,
+};
+
+// Types of the primitive stream, must match the PRIM_* defines of raytracer.comp
+// The first five have their intersection data in the geometry buffer, in this order
+enum PrimitiveTypes{
+    PRIM_SPHERE = 0,
+    PRIM_TRIANGLE = 1,
+    PRIM_PARALLELOGRAM = 2,
+    PRIM_DISK = 3,
+    PRIM_BOX = 4,
+    PRIM_MESH = 5,
+    PRIM_PLANE = 6,
 };
 
 
@@ -19,6 +33,7 @@ struct alignas(16) Sphere{
     glm::vec3 pos;
     float r;
     int mat;
+    int light;      // Index in the lights list if emissive, -1 otherwise. Filled by the scene
 };
 
 struct alignas(16) Triangle{
@@ -27,6 +42,70 @@ struct alignas(16) Triangle{
     alignas(16) glm::vec3 v2;
     alignas(16) glm::vec3 normal;
     int mat;
+    int light;      // Index in the lights list if emissive, -1 otherwise. Filled by the scene
+};
+
+// Baldwin-Weber transform of a triangle, rows of the affine map from world space to (u, v, plane distance)
+// Built by the scene for every triangle, it is what the intersection test reads
+struct TriangleTransform{
+    glm::vec4 row0;
+    glm::vec4 row1;
+    glm::vec4 row2;             // xyz is the normal over the squared double area
+};
+
+// Entry of the primitive stream, the single list of everything the traversal tests
+struct PrimitiveRef{
+    uint32_t type_id;       // PrimitiveTypes in the top 4 bits, index in the buffer of its type below
+    uint32_t triangle;      // Triangle of the mesh for PRIM_MESH, 0 otherwise
+};
+
+// Node of the BVH over the primitive stream, the nodes are stored in depth first order
+// The first child of an inner node is the next node, the second one is the miss link of the first
+struct BvhNode{
+    glm::vec3 bounds_min;
+    int miss;               // Node that follows this subtree in depth first order, -1 after the last one
+    glm::vec3 bounds_max;
+    uint32_t prims;         // Leaves: first reference << 4 | count. 0 for inner nodes
+};
+
+// Bounds of an analytic primitive in the ray query acceleration structure, laid out as VkAabbPositionsKHR
+struct Aabb{
+    glm::vec3 lo;
+    glm::vec3 hi;
+};
+
+// Parallelogram spanned by two edges from a corner
+struct alignas(16) Parallelogram{
+    alignas(16) glm::vec3 corner;
+    alignas(16) glm::vec3 edge1;
+    alignas(16) glm::vec3 edge2;
+    alignas(16) glm::vec3 normal;   // Filled by the scene
+    alignas(16) glm::vec3 w;        // Normal over its squared length, projects hits onto the edges. Filled by the scene
+    int mat;
+    int light;      // Index in the lights list if emissive, -1 otherwise. Filled by the scene
+};
+
+struct alignas(16) Disk{
+    glm::vec3 center;
+    float r;
+    glm::vec3 normal;
+    int mat;
+};
+
+// Box oriented along three perpendicular axes
+struct alignas(16) Box{
+    glm::vec3 center;
+    int mat;
+    glm::vec4 axis_x;       // Axis of the box, w is half its size along it. Normalized by the scene
+    glm::vec4 axis_y;
+    glm::vec4 axis_z;
+};
+
+// Infinite plane made of the points p where dot(normal, p) = offset
+struct alignas(16) Plane{
+    glm::vec3 normal;
+    float offset;
+    int mat;
 };
 
 struct Quad{
@@ -37,8 +116,9 @@ struct Quad{
     int mat;
 };
 
+// Tightly packed, the shaders read it with the scalar block layout
 struct Vertex{
-    alignas(16) glm::vec3 pos;
+    glm::vec3 pos;
 };
 
 // Based on Blender 4.5LTS Principled BSDF
@@ -70,6 +150,22 @@ struct Material {
 
     // Sheen
     // TODO
+
+    // Derived constants. Filled by the scene
+    glm::vec4 f0_alpha;         // Fresnel reflectance at normal incidence. Alpha is the GGX alpha, roughness squared
+};
+
+// Material as the shader reads it, 32 bytes instead of 96. Built from Material by the scene
+// Colors are unorm8 and the GGX terms half floats packed into uints
+struct PackedMaterial {
+    uint32_t albedo;            // rgba unorm8, alpha is the opacity
+    uint32_t subsurface;        // rgba unorm8, scatter distance and subsurface weight
+    uint32_t specular_tint;     // rgba unorm8, alpha is the IOR level
+    uint32_t f0_metallic;       // rgba unorm8, Fresnel reflectance at normal incidence and metallic weight
+    uint32_t emission_trs;      // rgba unorm8, emission color and transmission weight
+    uint32_t roughness_alpha;   // Two half floats, roughness and GGX alpha
+    float ior;                  // Kept as float, half can not tell it apart from 1.0
+    float emission_strength;    // Unbounded
 };
 
 
@@ -80,10 +176,20 @@ struct alignas(16) Light{
     float accumulated_str;
 };
 
+// Walker/Vose alias table entry, one per light
+struct LightAlias{
+    float prob;                 // Probability of keeping this bucket's own light
+    int alias;                  // Light picked when the bucket's own light is rejected
+    float pdf;                  // Selection probability of this bucket's own light
+};
+
 struct MeshInfo{
     uint index_start;
     uint index_end;
     int material;
+    int light;      // Index in the lights list if emissive, -1 otherwise. Filled by the scene
+    int quantized;  // 1 if the positions are 16 bit integers in the quantized vertex buffer
+    alignas(16) glm::vec4 dequantize[3];    // Rows of the affine map from the integers to world space
 };
 
 struct Model{
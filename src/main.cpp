@@ -12,6 +12,7 @@
 #include <vector>
 #include <set>
 #include <cstdint>
+#include <cstddef>
 #include <limits>
 #include <algorithm>
 #include <fstream>
@@ -23,6 +24,7 @@
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <random>
 
 #include "scene.hpp"
 
@@ -55,10 +57,20 @@ const vector<const char *> validationLayers = {
 
 // Extensions requiered to have
 const vector<const char *> deviceExtensions = {
-    VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    VK_EXT_SCALAR_BLOCK_LAYOUT_EXTENSION_NAME};
+
+// Extensions of the optional ray query backend, enabled on top of deviceExtensions when all are present
+const vector<const char *> rayQueryExtensions = {
+    VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+    VK_KHR_RAY_QUERY_EXTENSION_NAME,
+    VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME};
 
 // Number of shader storage buffers used
-const int numSSBO = 7;
+const int numSSBO = 27;
+
+// Number of per pixel buffers in the frame accumulation descriptor set
+const int numFrameAccumBuffers = 9;
 
 // World vetors
 const glm::vec4 worldFront = glm::vec4(0.0f, 0.0f, -1.0f, 0.0f);
@@ -95,6 +107,123 @@ const bool frameAccumulationInitial = true;
 // Static render mode, if true only renders the first frame of the scene 
 const bool staticRenderMode = false;
 
+// Number of light samples taken for next event estimation at every non-specular path vertex
+const int lightSamplesPerVertex = 1;
+
+// Initial value for the toggle of the SVGF denoiser passes
+const bool denoiserInitial = false;
+
+// Number of a-trous wavelet iterations of the denoiser, each one doubles the filter footprint
+const int denoiserIterations = 5;
+
+// Bits of PushConstants::features, must match common.glsl
+const uint32_t FEATURE_DENOISER = 1;
+const uint32_t FEATURE_CAMERA_MOVED = 2;
+const uint32_t FEATURE_RESTIR = 4;
+const uint32_t FEATURE_GUIDING = 8;
+const uint32_t FEATURE_RESIZED = 16;
+const uint32_t FEATURE_RADIANCE_CACHE = 32;
+const uint32_t FEATURE_PHOTONS = 64;
+
+// Initial value for the toggle of ReSTIR direct lighting, off uses plain light sampling
+const bool restirInitial = false;
+
+// Passes of raytracer.comp selected with its specialization constant, must match the shader
+const int PASS_TRACE = 0;
+const int PASS_RESTIR_INITIAL = 1;
+const int PASS_RESTIR_SPATIAL = 2;
+const int PASS_PREVIEW_ALBEDO = 3;
+const int PASS_PREVIEW_AO = 4;
+const int PASS_PREVIEW_DIRECT = 5;
+const int PASS_PHOTONS = 6;
+
+// Ways raytracer.comp can walk the scene, selected with its specialization constant, must match the shader
+const int TRAVERSAL_BRUTE_FORCE = 0;    // Every primitive, no hierarchy
+const int TRAVERSAL_STACK = 1;          // BVH with a per invocation stack
+const int TRAVERSAL_STACKLESS = 2;      // BVH following the skip links of its nodes, no stack
+
+// Traversal the trace pipelines are created with
+const int traversalInitial = TRAVERSAL_STACKLESS;
+
+// Primary rays and mirror reflections walk the BVH one subgroup at a time when their directions agree
+// Needs subgroup vote, ballot and arithmetic in compute shaders, turned off on devices without them
+const bool packetTraversalInitial = true;
+
+// Trace through hardware acceleration structures with VK_KHR_ray_query when the device has it
+// raytracer.comp built with RAY_QUERY, the compute traversal stays the fallback
+const bool rayQueryInitial = true;
+
+// Integrator used while the camera moves, one of the PASS_PREVIEW_* passes. PASS_TRACE keeps the path tracer
+const int previewModeInitial = PASS_PREVIEW_DIRECT;
+
+// Seconds without camera movement after which the path tracer takes over from the preview
+const float previewHoldTime = 0.1f;
+
+// Initial value for the toggle of path guiding, off samples only the BSDF
+const bool guidingInitial = false;
+
+// Path guiding grid and quadtree sizes, must match guiding.glsl
+const int guidingCells = 16 * 16 * 16;
+const int guidingLeaves = 64;
+const int guidingNodes = 85;
+
+// Initial value for the toggle of the radiance cache, off traces every path to the end
+const bool radianceCacheInitial = false;
+
+// Entries of the radiance cache hash table, the least recently used are replaced when it fills up
+const int radianceCacheEntries = 1 << 18;
+
+// Bytes of each entry, must match RadianceCacheEntry in radiance_cache.glsl
+const VkDeviceSize radianceCacheEntrySize = 48;
+
+// Initial value for the toggle of the caustic photon map, off leaves caustics to the path tracer
+const bool photonsInitial = false;
+
+// Photons emitted each frame, a multiple of the 32x32 work group
+const int photonsPerFrame = 1 << 16;
+
+// Bytes of each stored photon, must match Photon in photons.glsl
+const VkDeviceSize photonSize = 64;
+
+// Buckets of the photon hash grid
+const int photonGridBuckets = 1 << 18;
+
+// Initial value for the toggle of dynamic resolution, off always renders at the swapchain resolution
+const bool dynamicResolutionInitial = false;
+
+// GPU frame time the dynamic resolution tries to hold
+const float targetFrameTimeMs = 16.6f;
+
+// Render scale limits, a scale applies to both axes
+const float minRenderScale = 0.5f;
+const float renderScaleStep = 0.05f;    // Scales are rounded to this so timing noise does not restart accumulation
+
+// Frames between render scale changes, lets the frame time settle
+const int renderScaleCooldown = 30;
+
+// Initial value for the toggle of the EASU + RCAS upscaler, off upsamples with a bilinear filter
+// Static renders always bypass it and render at full resolution
+const bool upscalerInitial = false;
+
+// Render scale used with the upscaler when dynamic resolution is off
+const float upscalerRenderScale = 0.67f;
+
+// Frames rendered at startup with each geometry layout, AoS then SoA, to compare their GPU frame time. 0 skips it
+// Most telling on a scene that mixes spheres, triangles, analytic primitives and meshes
+const int layoutBenchmarkFrames = 0;
+
+// Frames rendered at startup with each traversal, brute force, stack and stackless, to compare their GPU frame time
+// 0 skips it. Lowering BVH_MAX_LEAF_SIZE in scene.hpp deepens the hierarchy
+const int traversalBenchmarkFrames = 0;
+
+// Frames rendered at startup with the compute traversal and with ray queries, prints the rays per second of each
+// 0 skips it. The trace pipelines count every ray they trace while it runs
+const int rayQueryBenchmarkFrames = 0;
+
+// Light picks timed at startup with the strength binary search and with the alias table, for 10, 1k and 100k lights
+// 0 skips it. A CPU proxy of the shader selection over random strengths, the GPU dependent reads are not timed
+const int lightSelectionBenchmarkSamples = 0;
+
 
 // -----------------------------------------------------------------------------
 //  The application class
@@ -107,6 +236,18 @@ public:
     {
         initWindow();
         initVulkan();
+        if(lightSelectionBenchmarkSamples > 0){
+            runLightSelectionBenchmark();
+        }
+        if(layoutBenchmarkFrames > 0){
+            runLayoutBenchmark();
+        }
+        if(traversalBenchmarkFrames > 0){
+            runTraversalBenchmark();
+        }
+        if(rayQueryBenchmarkFrames > 0){
+            runRayQueryBenchmark();
+        }
         if(staticRenderMode){
             mainLoopStatic();
         }else{
@@ -137,6 +278,15 @@ private:
         vector<VkPresentModeKHR> presentModes;
     };    
 
+    // Acceleration structure with the buffer that stores it
+    struct AccelerationStructure
+    {
+        VkAccelerationStructureKHR handle = VK_NULL_HANDLE;
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceAddress address = 0;
+    };
+
     // All the info about the camera in each frame
     struct Camera
     {
@@ -145,6 +295,7 @@ private:
         glm::mat4 proj;
         glm::mat4 projInv;
         glm::mat4 viewproj;
+        glm::mat4 prevViewproj;
         glm::vec3 position;
         float tanHalfFOV;
     };
@@ -153,6 +304,8 @@ private:
     struct UniformBufferObject
     {
         Camera camera;
+        glm::vec4 sceneMin;
+        glm::vec4 sceneMax;
     };
 
     struct PushConstants
@@ -166,6 +319,21 @@ private:
         int total_spheres;
         int total_triangles;
         int total_meshes;
+        int light_samples;
+        uint32_t features;
+        uint32_t frame_index;
+        int denoiser_step;
+        int denoiser_iterations;
+        int environment_light;
+        int render_width;
+        int render_height;
+        int photons_per_frame;
+        uint32_t photon_iteration;
+        int total_parallelograms;
+        int total_disks;
+        int total_boxes;
+        int total_planes;
+        int total_primitives;
     };
 
     // -------------------------------------------------------------------------
@@ -200,6 +368,18 @@ private:
     // Pipelines
     VkPipelineLayout pipelineLayout;              
     VkPipeline computePipeline;
+    VkPipeline denoiserTemporalPipeline;
+    VkPipeline denoiserVariancePipeline;
+    VkPipeline denoiserAtrousPipeline;
+    VkPipeline restirInitialPipeline;
+    VkPipeline restirSpatialPipeline;
+    array<VkPipeline, 3> previewPipelines;      // Indexed by pass - PASS_PREVIEW_ALBEDO
+    VkPipeline guidingBuildPipeline;
+    VkPipeline radianceCacheUpdatePipeline;
+    VkPipeline photonPipeline;
+    VkPipeline upsamplePipeline;
+    VkPipeline easuPipeline;
+    VkPipeline rcasPipeline;
 
     // Commands
     VkCommandPool commandPool;
@@ -233,10 +413,9 @@ private:
     vector<VkDeviceMemory> shaderStorageBufferMemory = vector<VkDeviceMemory>(numSSBO);
 
     // Frame accumulation buffers
-    VkBuffer colorAccumulationBuffer;
-    VkDeviceMemory colorAccumulationBufferMemory;
-    VkBuffer sampleCountBuffer;
-    VkDeviceMemory sampleCountBufferMemory;
+    // Per pixel buffers: accumulated colors, sample counts, G-buffer, frame colors, denoiser history and filter, reservoirs
+    vector<VkBuffer> frameAccumBuffers = vector<VkBuffer>(numFrameAccumBuffers);
+    vector<VkDeviceMemory> frameAccumBufferMemory = vector<VkDeviceMemory>(numFrameAccumBuffers);
 
     // Sync Objects
     vector<VkSemaphore> imageAvailableSemaphores;
@@ -270,7 +449,64 @@ private:
 
     // Frame accumulation
     bool resetFrameAccumulation = true;
+    // Set when the camera moved this frame, the accumulation is reprojected instead of reset
+    bool cameraMoved = false;
     bool frameAccumulationOn = frameAccumulationInitial;
+    bool denoiserOn = denoiserInitial;
+    bool restirOn = restirInitial;
+    bool guidingOn = guidingInitial;
+    // Set when what the guiding learned is no longer valid, the buffers are cleared on the next frame
+    bool resetGuiding = false;
+    bool radianceCacheOn = radianceCacheInitial;
+    // Set when the cached radiance is no longer valid, the cache is cleared on the next frame
+    bool resetRadianceCache = false;
+    bool photonsOn = photonsInitial;
+    // Frames the photon map has been refined for since the image was last reset
+    uint32_t photonIteration = 0;
+
+    // Preview integrators
+    int previewMode = previewModeInitial;
+    bool previewing = false;            // True while the preview replaces the path tracer
+    bool previewedSinceTrace = false;   // The camera moved under a preview since the last traced frame
+    double lastCameraMoveTime = -1.0;
+
+    // Frames traced since start, unlike frameCount it never resets. Previews do not advance it
+    uint32_t frameIndex = 0;
+    glm::mat4 prevViewproj = glm::mat4(1.0);
+
+    // Dynamic resolution
+    bool dynamicResolutionOn = dynamicResolutionInitial;
+    bool upscalerOn = upscalerInitial && !staticRenderMode;
+    int traversal = traversalInitial;
+    bool packetTraversal = packetTraversalInitial;
+    bool countRays = false;     // Trace pipelines add the rays they trace to SSBO 25
+    float renderScale = 1.0f;
+    uint32_t renderWidth = WIDTH;
+    uint32_t renderHeight = HEIGHT;
+    // Set when the render scale changed, the previous frame buffers have another layout
+    bool renderScaleChanged = false;
+    int framesSinceScaleChange = 0;
+
+    // GPU timestamps written at the start and end of each frame in flight
+    VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+    float timestampPeriod = 0.0f;   // Nanoseconds per timestamp tick, 0.0 if timestamps are unsupported
+    vector<bool> timestampsWritten = vector<bool>(MAX_FRAMES_IN_FLIGHT, false);
+    vector<bool> timestampsPreviewed = vector<bool>(MAX_FRAMES_IN_FLIGHT, false);   // Timed a preview, not the path tracer
+    float gpuFrameTimeMs = 0.0f;    // Moving average
+    float lastGpuFrameTimeMs = 0.0f;
+
+    // Ray query backend
+    bool rayQuerySupported = false;     // Set by pickPhysicalDevice()
+    VkDeviceSize scratchAlignment = 1;  // Required alignment of acceleration structure scratch addresses
+    bool rayQueryOn = false;
+    AccelerationStructure blasTriangles;
+    AccelerationStructure blasAabbs;
+    AccelerationStructure tlas;
+    PFN_vkCreateAccelerationStructureKHR pfnCreateAccelerationStructure = nullptr;
+    PFN_vkDestroyAccelerationStructureKHR pfnDestroyAccelerationStructure = nullptr;
+    PFN_vkGetAccelerationStructureBuildSizesKHR pfnGetAccelerationStructureBuildSizes = nullptr;
+    PFN_vkCmdBuildAccelerationStructuresKHR pfnCmdBuildAccelerationStructures = nullptr;
+    PFN_vkGetAccelerationStructureDeviceAddressKHR pfnGetAccelerationStructureDeviceAddress = nullptr;
 
 
     
@@ -293,6 +529,176 @@ private:
         vkDeviceWaitIdle(device);
     }
 
+    // Renders frames with the current trace pipelines and returns their average GPU frame time
+    float timeTraceFrames(int frames)
+    {
+        resetFrameAccumulation = true;
+        float totalMs = 0.0f;
+        int timed = 0;
+        for(int i = 0; i < frames && !glfwWindowShouldClose(window); i++){
+            glfwPollEvents();
+            drawFrame();
+            // The first frames in flight read timestamps of the previous configuration
+            if(i >= MAX_FRAMES_IN_FLIGHT){
+                totalMs += lastGpuFrameTimeMs;
+                timed++;
+            }
+        }
+        return timed > 0 ? totalMs / timed : 0.0f;
+    }
+
+    // Picks lightSelectionBenchmarkSamples lights by binary search over the accumulated strengths and by the alias table
+    // Both follow pick_light in the shader, the checksum keeps the compiler from dropping the picks
+    void runLightSelectionBenchmark()
+    {
+        mt19937 rng(1234);
+        uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        vector<float> randoms(lightSelectionBenchmarkSamples);
+        for(float& r : randoms) r = uniform(rng);
+
+        for(int n : {10, 1000, 100000}){
+            vector<float> strengths(n);
+            vector<float> accumulated(n);
+            float sum = 0.0f;
+            for(int i = 0; i < n; i++){
+                strengths[i] = 0.1f + 10.0f * uniform(rng);
+                sum += strengths[i];
+                accumulated[i] = sum;
+            }
+            vector<LightAlias> table = buildAliasTable(strengths);
+
+            long long checksum = 0;
+            auto start = chrono::high_resolution_clock::now();
+            for(int s = 0; s < lightSelectionBenchmarkSamples; s++){
+                float randStrength = randoms[s] * sum;
+                int low = 0, high = n - 1;
+                while(low < high){
+                    int mid = (low + high) / 2;
+                    if(accumulated[mid] < randStrength) low = mid + 1;
+                    else high = mid;
+                }
+                checksum += low;
+            }
+            auto middle = chrono::high_resolution_clock::now();
+            for(int s = 0; s < lightSelectionBenchmarkSamples; s++){
+                float randBucket = randoms[s] * n;
+                int bucket = min(int(randBucket), n - 1);
+                checksum += (randBucket - bucket) < table[bucket].prob ? bucket : table[bucket].alias;
+            }
+            auto end = chrono::high_resolution_clock::now();
+
+            double searchNs = chrono::duration<double, nano>(middle - start).count() / double(lightSelectionBenchmarkSamples);
+            double aliasNs = chrono::duration<double, nano>(end - middle).count() / double(lightSelectionBenchmarkSamples);
+            cout << n << " lights (CPU proxy): binary search " << searchNs << " ns, alias table " << aliasNs
+                 << " ns per pick (checksum " << checksum << ")" << endl;
+        }
+    }
+
+    // Renders layoutBenchmarkFrames frames with each geometry layout and prints their average GPU frame time
+    // The layouts have the same size, switching re-uploads the geometry buffer and rebuilds the trace pipelines
+    void runLayoutBenchmark()
+    {
+        if(timestampQueryPool == VK_NULL_HANDLE){
+            cout << "Layout benchmark skipped, the device has no compute timestamps" << endl;
+            return;
+        }
+
+        for(bool soa : {false, true}){
+            vkDeviceWaitIdle(device);
+            scene.soaGeometry = soa;
+            updateSSBOVector(21, scene.packGeometry(soa));
+            destroyTracePipelines();
+            createTracePipelines();
+            cout << "Geometry layout " << (soa ? "SoA" : "AoS") << ": "
+                 << timeTraceFrames(layoutBenchmarkFrames) << " ms per frame" << endl;
+        }
+    }
+
+    // Renders rayQueryBenchmarkFrames frames with the compute traversal and with ray queries
+    // Rays per second are the rays counted by the shader per frame over the average GPU frame time
+    void runRayQueryBenchmark()
+    {
+        if(timestampQueryPool == VK_NULL_HANDLE){
+            cout << "Ray query benchmark skipped, the device has no compute timestamps" << endl;
+            return;
+        }
+
+        bool selected = rayQueryOn;
+        countRays = true;
+        for(bool rayQuery : {false, true}){
+            if(rayQuery && !rayQuerySupported){
+                cout << "Ray query backend not supported, only the compute traversal was measured" << endl;
+                continue;
+            }
+            vkDeviceWaitIdle(device);
+            rayQueryOn = rayQuery;
+            destroyTracePipelines();
+            createTracePipelines();
+            readRayCount();
+
+            float ms = timeTraceFrames(rayQueryBenchmarkFrames);
+            double raysPerFrame = double(readRayCount()) / double(rayQueryBenchmarkFrames);
+            cout << (rayQuery ? "Ray query" : "Compute traversal") << ": " << ms << " ms per frame, "
+                 << (ms > 0.0f ? raysPerFrame / (ms * 1e3) : 0.0) << " Mrays/s" << endl;
+        }
+
+        vkDeviceWaitIdle(device);
+        rayQueryOn = selected;
+        countRays = false;
+        destroyTracePipelines();
+        createTracePipelines();
+    }
+
+    // Rays counted by the trace pipelines since the last call, then clears the counter. Waits for the device
+    uint64_t readRayCount()
+    {
+        vkDeviceWaitIdle(device);
+
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        createBuffer(2 * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            stagingBuffer, stagingBufferMemory);
+        copyBuffer(shaderStorageBuffers[25], stagingBuffer, 2 * sizeof(uint32_t));
+
+        uint32_t words[2];
+        void* data;
+        vkMapMemory(device, stagingBufferMemory, 0, sizeof(words), 0, &data);
+            memcpy(words, data, sizeof(words));
+        vkUnmapMemory(device, stagingBufferMemory);
+
+        vkDestroyBuffer(device,stagingBuffer,nullptr);
+        vkFreeMemory(device,stagingBufferMemory,nullptr);
+
+        initializeBufferWithZeros(shaderStorageBuffers[25], 2 * sizeof(uint32_t));
+        return uint64_t(words[1]) << 32 | words[0];
+    }
+
+    // Renders traversalBenchmarkFrames frames with each traversal and prints their average GPU frame time
+    void runTraversalBenchmark()
+    {
+        if(timestampQueryPool == VK_NULL_HANDLE){
+            cout << "Traversal benchmark skipped, the device has no compute timestamps" << endl;
+            return;
+        }
+
+        const char* names[] = {"brute force", "stack", "stackless"};
+        int selected = traversal;
+        cout << "Traversal benchmark, " << scene.total_primitives << " primitives, BVH depth " << scene.bvhDepth << endl;
+        for(int mode : {TRAVERSAL_BRUTE_FORCE, TRAVERSAL_STACK, TRAVERSAL_STACKLESS}){
+            vkDeviceWaitIdle(device);
+            traversal = mode;
+            destroyTracePipelines();
+            createTracePipelines();
+            cout << "Traversal " << names[mode] << ": " << timeTraceFrames(traversalBenchmarkFrames) << " ms per frame" << endl;
+        }
+
+        vkDeviceWaitIdle(device);
+        traversal = selected;
+        destroyTracePipelines();
+        createTracePipelines();
+    }
+
     void mainLoopStatic()
     {
         drawFrame();
@@ -342,11 +748,15 @@ private:
             vkFreeMemory(device, shaderStorageBufferMemory[i], nullptr);
         }
 
-        vkDestroyBuffer(device, colorAccumulationBuffer, nullptr);
-        vkFreeMemory(device, colorAccumulationBufferMemory, nullptr);
+        for (size_t i = 0; i < frameAccumBuffers.size(); i++)
+        {
+            vkDestroyBuffer(device, frameAccumBuffers[i], nullptr);
+            vkFreeMemory(device, frameAccumBufferMemory[i], nullptr);
+        }
 
-        vkDestroyBuffer(device, sampleCountBuffer, nullptr);
-        vkFreeMemory(device, sampleCountBufferMemory, nullptr);
+        if(rayQuerySupported){
+            destroyAccelerationStructures();
+        }
 
         vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
@@ -354,7 +764,15 @@ private:
         vkDestroyDescriptorSetLayout(device, descriptorSetLayoutGlobal, nullptr);
         vkDestroyDescriptorSetLayout(device, descriptorSetLayoutFrameAccum, nullptr);
 
-        vkDestroyPipeline(device, computePipeline, nullptr);
+        destroyTracePipelines();
+        vkDestroyPipeline(device, denoiserTemporalPipeline, nullptr);
+        vkDestroyPipeline(device, denoiserVariancePipeline, nullptr);
+        vkDestroyPipeline(device, denoiserAtrousPipeline, nullptr);
+        vkDestroyPipeline(device, guidingBuildPipeline, nullptr);
+        vkDestroyPipeline(device, radianceCacheUpdatePipeline, nullptr);
+        vkDestroyPipeline(device, upsamplePipeline, nullptr);
+        vkDestroyPipeline(device, easuPipeline, nullptr);
+        vkDestroyPipeline(device, rcasPipeline, nullptr);
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
@@ -364,6 +782,10 @@ private:
             vkDestroyFence(device, inFlightFences[i], nullptr);
         }
 
+        if(timestampQueryPool != VK_NULL_HANDLE){
+            vkDestroyQueryPool(device, timestampQueryPool, nullptr);
+        }
+
         vkDestroyCommandPool(device, commandPool, nullptr);
 
         vkDestroyDevice(device, nullptr);
@@ -414,30 +836,31 @@ private:
 
         if(planeMode){
             cameraPos += moveSpeedDelta * cameraFront;
+            cameraMoved = true;
         }else{
             if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS){
                 cameraPos += moveSpeedDelta * glm::normalize(cameraFront);
-                resetFrameAccumulation = true;
+                cameraMoved = true;
             }
             if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS){
                 cameraPos -= moveSpeedDelta * glm::normalize(cameraFront);
-                resetFrameAccumulation = true;
+                cameraMoved = true;
             }
             if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS){
                 cameraPos -= glm::normalize(glm::cross(cameraFront, cameraUp)) * moveSpeedDelta;
-                resetFrameAccumulation = true;
+                cameraMoved = true;
             }
             if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS){
                 cameraPos += glm::normalize(glm::cross(cameraFront, cameraUp)) * moveSpeedDelta;
-                resetFrameAccumulation = true;
+                cameraMoved = true;
             }
             if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS){
                 cameraPos += moveSpeedDelta * cameraUp;
-                resetFrameAccumulation = true;
+                cameraMoved = true;
             }
             if (glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS){
                 cameraPos -= moveSpeedDelta * cameraUp;
-                resetFrameAccumulation = true;
+                cameraMoved = true;
             }
         }
 
@@ -470,6 +893,9 @@ private:
             fov = fovInitial;
             rotateMatrix = true;
             frameAccumulationOn = frameAccumulationInitial;
+            resetFrameAccumulation = true;
+            resetGuiding = true;
+            resetRadianceCache = true;
         }
 
         static bool xBounce = false;
@@ -481,6 +907,86 @@ private:
             xBounce = false;
         } 
 
+        static bool vBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS && !vBounce){
+            denoiserOn = !denoiserOn;
+            vBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_V) == GLFW_RELEASE && vBounce){
+            vBounce = false;
+        } 
+
+        static bool bBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS && !bBounce){
+            restirOn = !restirOn;
+            resetFrameAccumulation = true;
+            bBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_B) == GLFW_RELEASE && bBounce){
+            bBounce = false;
+        } 
+
+        static bool gBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS && !gBounce){
+            guidingOn = !guidingOn;
+            resetGuiding = true;
+            resetFrameAccumulation = true;
+            gBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_G) == GLFW_RELEASE && gBounce){
+            gBounce = false;
+        } 
+
+        // Cycles the preview integrator: none, albedo, ambient occlusion, direct light
+        static bool pBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS && !pBounce){
+            previewMode = previewMode == PASS_TRACE ? PASS_PREVIEW_ALBEDO : previewMode + 1;
+            if(previewMode > PASS_PREVIEW_DIRECT) previewMode = PASS_TRACE;
+            pBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_P) == GLFW_RELEASE && pBounce){
+            pBounce = false;
+        } 
+
+        static bool cBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS && !cBounce){
+            radianceCacheOn = !radianceCacheOn;
+            resetRadianceCache = true;
+            resetFrameAccumulation = true;
+            cBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_C) == GLFW_RELEASE && cBounce){
+            cBounce = false;
+        } 
+
+        static bool mBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS && !mBounce){
+            photonsOn = !photonsOn;
+            resetFrameAccumulation = true;
+            mBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_M) == GLFW_RELEASE && mBounce){
+            mBounce = false;
+        } 
+
+        static bool tBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS && !tBounce){
+            dynamicResolutionOn = !dynamicResolutionOn;
+            tBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_T) == GLFW_RELEASE && tBounce){
+            tBounce = false;
+        } 
+
+        static bool uBounce = false;
+        if (glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS && !uBounce){
+            upscalerOn = !upscalerOn;
+            uBounce = true;
+        } 
+        if (glfwGetKey(window, GLFW_KEY_U) == GLFW_RELEASE && uBounce){
+            uBounce = false;
+        } 
+
         if(rotateMatrix){
             if(roll>360.0) roll -= 360.0;
             if(roll<0.0) roll += 360.0;
@@ -546,13 +1052,13 @@ private:
         fov -= static_cast<float>(yoffset)*fovIncreaseAmount;
         if(fov < 1.0) fov = 1.0;
         if(fov > 160.0) fov = 160.0;
-        resetFrameAccumulation = true;
+        cameraMoved = true;
     }
 
 
     // Updates rotation matrix and camera front and up
     void updateCamera(){
-        resetFrameAccumulation = true;
+        cameraMoved = true;
 
         rotation = glm::yawPitchRoll(
             -glm::radians(yaw),
@@ -571,15 +1077,23 @@ private:
         setupDebugMessenger();
         createSurface();
         pickPhysicalDevice();
+        checkSubgroupSupport();
         createLogicalDevice();
+        if(rayQuerySupported){
+            loadRayQueryFunctions();
+        }
         createSwapChain();
         createImageViews();
         createDescriptorSetLayout();
         createComputePipeline();
         createCommandPool();
+        createTimestampQueryPool();
         createUniformBuffers();
         createImageBuffer(WIDTH,HEIGHT);
         createShaderStorageBuffers();
+        if(rayQuerySupported){
+            createAccelerationStructures();
+        }
         createFrameAccumulationBuffers(WIDTH,HEIGHT);
         createDescriptorPool();
         createDescriptorSets(WIDTH,HEIGHT);
@@ -601,7 +1115,7 @@ private:
         appInfo.applicationVersion = VK_MAKE_API_VERSION(1, 0, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_API_VERSION(1, 0, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        appInfo.apiVersion = VK_API_VERSION_1_2;
 
         // Main instance-creation structure
         VkInstanceCreateInfo createInfo{};
@@ -815,6 +1329,85 @@ private:
             physicalDevice = candidates.rbegin()->second;
         else
             throw runtime_error("Failed to find a suitable GPU");
+
+        // Ray queries are optional, the compute traversal covers devices without them
+        rayQuerySupported = checkRayQuerySupport(physicalDevice);
+        rayQueryOn = rayQueryInitial && rayQuerySupported;
+        if(rayQueryInitial && !rayQuerySupported)
+            cout << "Ray queries not supported, tracing with the compute traversal" << endl;
+
+        if(rayQuerySupported){
+            VkPhysicalDeviceAccelerationStructurePropertiesKHR asProps{};
+            asProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+            VkPhysicalDeviceProperties2 props{};
+            props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+            props.pNext = &asProps;
+            vkGetPhysicalDeviceProperties2(physicalDevice, &props);
+            scratchAlignment = max(VkDeviceSize(asProps.minAccelerationStructureScratchOffsetAlignment), VkDeviceSize(1));
+        }
+    }
+
+    // The ray query shader is SPIR-V 1.4, so it also needs a Vulkan 1.2 device
+    bool checkRayQuerySupport(VkPhysicalDevice device)
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(device, &props);
+        if(props.apiVersion < VK_API_VERSION_1_2)
+            return false;
+
+        uint32_t extensionCount;
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+        vector<VkExtensionProperties> availableExtensions(extensionCount);
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+
+        set<string> requiredExtensions(rayQueryExtensions.begin(), rayQueryExtensions.end());
+        for (const auto &extension : availableExtensions)
+        {
+            requiredExtensions.erase(extension.extensionName);
+        }
+        if(!requiredExtensions.empty())
+            return false;
+
+        VkPhysicalDeviceBufferDeviceAddressFeatures addressFeatures{};
+        addressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+        VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationFeatures{};
+        accelerationFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+        accelerationFeatures.pNext = &addressFeatures;
+        VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures{};
+        rayQueryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
+        rayQueryFeatures.pNext = &accelerationFeatures;
+        VkPhysicalDeviceFeatures2 features{};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &rayQueryFeatures;
+        vkGetPhysicalDeviceFeatures2(device, &features);
+
+        return rayQueryFeatures.rayQuery && accelerationFeatures.accelerationStructure && addressFeatures.bufferDeviceAddress;
+    }
+
+    // Packet traversal votes and shares its stack through subgroup operations
+    void checkSubgroupSupport()
+    {
+        // The subgroup properties are only queryable on a Vulkan 1.1 device
+        VkPhysicalDeviceProperties baseProps;
+        vkGetPhysicalDeviceProperties(physicalDevice, &baseProps);
+        if(baseProps.apiVersion < VK_API_VERSION_1_1){
+            if(packetTraversal) cout << "Vulkan 1.1 not supported, packet traversal disabled" << endl;
+            packetTraversal = false;
+            return;
+        }
+
+        VkPhysicalDeviceSubgroupProperties subgroupProps{};
+        subgroupProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+        VkPhysicalDeviceProperties2 props{};
+        props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        props.pNext = &subgroupProps;
+        vkGetPhysicalDeviceProperties2(physicalDevice, &props);
+
+        VkSubgroupFeatureFlags needed = VK_SUBGROUP_FEATURE_VOTE_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+        if(!(subgroupProps.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) || (subgroupProps.supportedOperations & needed) != needed){
+            if(packetTraversal) cout << "Subgroup operations not supported, packet traversal disabled" << endl;
+            packetTraversal = false;
+        }
     }
 
     // Assign a score to each GPU. Higher is better; 0 means “unsuitable”. 
@@ -922,14 +1515,39 @@ private:
 
         VkPhysicalDeviceFeatures deviceFeatures{}; // Nothing special requested
 
+        // Vertices are read tightly packed
+        VkPhysicalDeviceScalarBlockLayoutFeaturesEXT scalarBlockLayoutFeatures{};
+        scalarBlockLayoutFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SCALAR_BLOCK_LAYOUT_FEATURES_EXT;
+        scalarBlockLayoutFeatures.scalarBlockLayout = VK_TRUE;
+
+        // The ray query backend builds its acceleration structures from buffer device addresses
+        VkPhysicalDeviceBufferDeviceAddressFeatures addressFeatures{};
+        addressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+        addressFeatures.bufferDeviceAddress = VK_TRUE;
+        VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationFeatures{};
+        accelerationFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+        accelerationFeatures.pNext = &addressFeatures;
+        accelerationFeatures.accelerationStructure = VK_TRUE;
+        VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures{};
+        rayQueryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
+        rayQueryFeatures.pNext = &accelerationFeatures;
+        rayQueryFeatures.rayQuery = VK_TRUE;
+
+        vector<const char *> extensions = deviceExtensions;
+        if(rayQuerySupported){
+            extensions.insert(extensions.end(), rayQueryExtensions.begin(), rayQueryExtensions.end());
+            scalarBlockLayoutFeatures.pNext = &rayQueryFeatures;
+        }
+
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+        createInfo.pNext = &scalarBlockLayoutFeatures;
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.pEnabledFeatures = &deviceFeatures;
 
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+        createInfo.ppEnabledExtensionNames = extensions.data();
 
         if (enableValidationLayers)
         {
@@ -1126,26 +1744,10 @@ private:
     // ---------------- Compute pipeline creation ------------------------------------------------
     void createComputePipeline()
     {
-        // Read compiled shader code from files
-        auto computeShaderCode = readFile(SPV_DIR+"raytracer.comp.spv");
-
-        // Create shader modules from code
-        VkShaderModule computeShaderModule = createShaderModule(computeShaderCode);
-
-        // ======================
-        // SHADER STAGE SETUP
-        // ======================
-
-        // Configure the compute shader stage
-        VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
-        computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-        computeShaderStageInfo.module = computeShaderModule;
-        computeShaderStageInfo.pName = "main"; // Entry point function
-
         // ======================
         // PIPELINE LAYOUT
         // ======================
+        // Shared by every pass so the descriptor sets and push constants are bound once
 
         VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
         pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -1170,19 +1772,180 @@ private:
         // PIPELINE CREATION
         // ======================
 
+        createTracePipelines();
+        denoiserTemporalPipeline = createComputePipelineFromShader("denoiser_temporal.comp.spv");
+        denoiserVariancePipeline = createComputePipelineFromShader("denoiser_variance.comp.spv");
+        denoiserAtrousPipeline = createComputePipelineFromShader("denoiser_atrous.comp.spv");
+        guidingBuildPipeline = createComputePipelineFromShader("guiding_build.comp.spv");
+        radianceCacheUpdatePipeline = createComputePipelineFromShader("radiance_cache_update.comp.spv");
+        upsamplePipeline = createComputePipelineFromShader("upsample.comp.spv");
+        easuPipeline = createComputePipelineFromShader("easu.comp.spv");
+        rcasPipeline = createComputePipelineFromShader("rcas.comp.spv");
+    }
+
+    // Passes of raytracer.comp, they depend on the scene layouts through the specialization constants
+    // The ray query build of the shader replaces the compute traversal when rayQueryOn is set
+    void createTracePipelines()
+    {
+        string shader = rayQueryOn ? "raytracer_ray_query.comp.spv" : "raytracer.comp.spv";
+        computePipeline = createComputePipelineFromShader(shader);
+        restirInitialPipeline = createComputePipelineFromShader(shader, PASS_RESTIR_INITIAL);
+        restirSpatialPipeline = createComputePipelineFromShader(shader, PASS_RESTIR_SPATIAL);
+        for(int i = 0; i < previewPipelines.size(); i++){
+            previewPipelines[i] = createComputePipelineFromShader(shader, PASS_PREVIEW_ALBEDO + i);
+        }
+        photonPipeline = createComputePipelineFromShader(shader, PASS_PHOTONS);
+    }
+
+    void destroyTracePipelines()
+    {
+        vkDestroyPipeline(device, computePipeline, nullptr);
+        vkDestroyPipeline(device, restirInitialPipeline, nullptr);
+        vkDestroyPipeline(device, restirSpatialPipeline, nullptr);
+        for(VkPipeline pipeline : previewPipelines){
+            vkDestroyPipeline(device, pipeline, nullptr);
+        }
+        vkDestroyPipeline(device, photonPipeline, nullptr);
+    }
+
+    // Creates a compute pipeline with the shared layout from a compiled shader in SPV_DIR
+    // passMode is written to the specialization constant 0 of the shader, the mesh layout of the scene to 1,
+    // the geometry layout to 2, the traversal to 3, the packet traversal switch to 4 and the ray counting switch to 5
+    VkPipeline createComputePipelineFromShader(const string &shaderName, int passMode = PASS_TRACE)
+    {
+        // Read compiled shader code from files
+        auto computeShaderCode = readFile(SPV_DIR+shaderName);
+
+        // Create shader modules from code
+        VkShaderModule computeShaderModule = createShaderModule(computeShaderCode);
+
+        // Configure the compute shader stage
+        VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
+        computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        computeShaderStageInfo.module = computeShaderModule;
+        computeShaderStageInfo.pName = "main"; // Entry point function
+
+        struct SpecializationData{
+            int passMode;
+            VkBool32 deindexedMeshes;
+            VkBool32 soaGeometry;
+            int traversal;
+            VkBool32 packetTraversal;
+            VkBool32 countRays;
+        } specializationData = {passMode, VkBool32(scene.meshesDeindexed), VkBool32(scene.soaGeometry), traversal,
+                                VkBool32(packetTraversal), VkBool32(countRays)};
+
+        array<VkSpecializationMapEntry, 6> specializationEntries{};
+        specializationEntries[0].constantID = 0;
+        specializationEntries[0].offset = offsetof(SpecializationData, passMode);
+        specializationEntries[0].size = sizeof(int);
+        specializationEntries[1].constantID = 1;
+        specializationEntries[1].offset = offsetof(SpecializationData, deindexedMeshes);
+        specializationEntries[1].size = sizeof(VkBool32);
+        specializationEntries[2].constantID = 2;
+        specializationEntries[2].offset = offsetof(SpecializationData, soaGeometry);
+        specializationEntries[2].size = sizeof(VkBool32);
+        specializationEntries[3].constantID = 3;
+        specializationEntries[3].offset = offsetof(SpecializationData, traversal);
+        specializationEntries[3].size = sizeof(int);
+        specializationEntries[4].constantID = 4;
+        specializationEntries[4].offset = offsetof(SpecializationData, packetTraversal);
+        specializationEntries[4].size = sizeof(VkBool32);
+        specializationEntries[5].constantID = 5;
+        specializationEntries[5].offset = offsetof(SpecializationData, countRays);
+        specializationEntries[5].size = sizeof(VkBool32);
+
+        VkSpecializationInfo specializationInfo{};
+        specializationInfo.mapEntryCount = specializationEntries.size();
+        specializationInfo.pMapEntries = specializationEntries.data();
+        specializationInfo.dataSize = sizeof(SpecializationData);
+        specializationInfo.pData = &specializationData;
+        computeShaderStageInfo.pSpecializationInfo = &specializationInfo;
+
         VkComputePipelineCreateInfo pipelineInfo{};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
         pipelineInfo.layout = pipelineLayout;
         pipelineInfo.stage = computeShaderStageInfo;
 
+        VkPipeline pipeline;
         if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, 
-            &pipelineInfo, nullptr, &computePipeline) != VK_SUCCESS) {
+            &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
 
-            throw runtime_error("failed to create compute pipeline!");
+            throw runtime_error("failed to create compute pipeline: "+shaderName);
         }
 
         // Clean up temporary shader modules
         vkDestroyShaderModule(device, computeShaderModule, nullptr);
+
+        return pipeline;
+    }
+
+    // ---------------- Timestamp queries ------------------------------------------------
+    // Two timestamps per frame in flight measure the GPU time the dynamic resolution reacts to
+    void createTimestampQueryPool()
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(physicalDevice, &props);
+        if(!props.limits.timestampComputeAndGraphics){
+            cout << "GPU timestamps not supported, dynamic resolution disabled" << endl;
+            return;
+        }
+        timestampPeriod = props.limits.timestampPeriod;
+
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+
+        if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPool) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to create timestamp query pool");
+        }
+    }
+
+    // Reads the timestamps of the last submission of this frame in flight, its fence has already been waited
+    void readGpuFrameTime()
+    {
+        if(timestampQueryPool == VK_NULL_HANDLE || !timestampsWritten[currentFrame]) return;
+        // Preview frames are far cheaper than traced ones and would mislead the resolution controller
+        if(timestampsPreviewed[currentFrame]) return;
+
+        uint64_t timestamps[2];
+        VkResult result = vkGetQueryPoolResults(device, timestampQueryPool, 2 * currentFrame, 2,
+                            sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+        if(result != VK_SUCCESS) return;
+
+        float frameTimeMs = float(timestamps[1] - timestamps[0]) * timestampPeriod / 1000000.0f;
+        lastGpuFrameTimeMs = frameTimeMs;
+        gpuFrameTimeMs = gpuFrameTimeMs == 0.0f ? frameTimeMs : glm::mix(gpuFrameTimeMs, frameTimeMs, 0.1f);
+    }
+
+    // Picks the render resolution of this frame from the measured GPU frame time
+    void updateRenderScale()
+    {
+        float scale = upscalerOn ? upscalerRenderScale : 1.0f;
+        if(dynamicResolutionOn && timestampQueryPool != VK_NULL_HANDLE){
+            scale = renderScale;
+            if(!previewing) framesSinceScaleChange++;
+            if(!previewing && framesSinceScaleChange >= renderScaleCooldown && gpuFrameTimeMs > 0.0f){
+                // The cost follows the pixel count, the square of the scale
+                scale = renderScale * glm::sqrt(targetFrameTimeMs / gpuFrameTimeMs);
+                scale = glm::round(scale / renderScaleStep) * renderScaleStep;
+                scale = glm::clamp(scale, minRenderScale, 1.0f);
+            }
+        }
+
+        if(scale != renderScale){
+            renderScale = scale;
+            renderScaleChanged = true;
+            resetFrameAccumulation = true;
+            framesSinceScaleChange = 0;
+            gpuFrameTimeMs = 0.0f;
+        }
+
+        renderWidth = std::max(1u, uint32_t(swapChainExtent.width * renderScale));
+        renderHeight = std::max(1u, uint32_t(swapChainExtent.height * renderScale));
     }
 
     // ---------------- Command pool/buffer creation ------------------------------------------------
@@ -1231,14 +1994,63 @@ private:
             throw runtime_error("failed to begin recording command buffer");
         }
 
-            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
+            if(timestampQueryPool != VK_NULL_HANDLE){
+                vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 2 * currentFrame, 2);
+                vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, 2 * currentFrame);
+            }
 
             array<VkDescriptorSet,3> descriptorSets= {descriptorSetsPerFrame[currentFrame],descriptorSetGlobal, descriptorSetFrameAccum};
             vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 3, descriptorSets.data(), 0, 0);
 
             vkCmdPushConstants(commandBuffer,pipelineLayout,VK_SHADER_STAGE_COMPUTE_BIT,0,sizeof(PushConstants),&pushConstants);
 
-            vkCmdDispatch(commandBuffer, (swapChainExtent.width + 31) / 32, (swapChainExtent.height + 31) / 32, 1);
+            if(resetGuiding){
+                recordSSBOClear(commandBuffer, {8, 9});
+            }
+            if(resetRadianceCache){
+                recordSSBOClear(commandBuffer, {12});
+            }
+
+            if(previewing){
+                // The preview writes the image itself, none of the path tracer passes run
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, previewPipelines[previewMode - PASS_PREVIEW_ALBEDO]);
+                vkCmdDispatch(commandBuffer, (renderWidth + 31) / 32, (renderHeight + 31) / 32, 1);
+            }else{
+                if(photonsOn){
+                    recordPhotons(commandBuffer);
+                }
+
+                if(restirOn){
+                    recordRestir(commandBuffer);
+                }
+
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
+
+                vkCmdDispatch(commandBuffer, (renderWidth + 31) / 32, (renderHeight + 31) / 32, 1);
+
+                if(guidingOn){
+                    recordGuidingBuild(commandBuffer);
+                }
+
+                if(radianceCacheOn){
+                    recordRadianceCacheUpdate(commandBuffer);
+                }
+
+                if(denoiserOn){
+                    recordDenoiser(commandBuffer);
+                }
+            }
+
+            // Below full scale the image is upsampled into a buffer that replaces outputImage as the copy source
+            bool upsample = renderWidth != swapChainExtent.width || renderHeight != swapChainExtent.height;
+            if(upsample){
+                recordUpsample(commandBuffer);
+            }
+
+            VkMemoryBarrier upsampleBarrier{};
+            upsampleBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            upsampleBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            upsampleBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
 
             VkImageMemoryBarrier startBarriers[2]{};
             startBarriers[0] = createMemoryBarrier(outputImage,
@@ -1256,7 +2068,7 @@ private:
             vkCmdPipelineBarrier(commandBuffer,
                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
                                 0,
-                                0, nullptr,
+                                1, &upsampleBarrier,
                                 0, nullptr,
                                 2, startBarriers);
 
@@ -1272,10 +2084,25 @@ private:
             copyRegion.extent = {swapChainExtent.width, swapChainExtent.height, 1};
 
 
-            vkCmdCopyImage(commandBuffer,
-                        outputImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                        swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                        1, &copyRegion);
+            if(upsample){
+                VkBufferImageCopy bufferRegion{};
+                bufferRegion.bufferOffset = 0;
+                bufferRegion.bufferRowLength = 0;
+                bufferRegion.bufferImageHeight = 0;
+                bufferRegion.imageSubresource = copyRegion.dstSubresource;
+                bufferRegion.imageOffset = {0, 0, 0};
+                bufferRegion.imageExtent = copyRegion.extent;
+
+                vkCmdCopyBufferToImage(commandBuffer,
+                            frameAccumBuffers[7],
+                            swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                            1, &bufferRegion);
+            }else{
+                vkCmdCopyImage(commandBuffer,
+                            outputImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                            swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                            1, &copyRegion);
+            }
 
 
             VkImageMemoryBarrier endBarriers[2]{};
@@ -1298,12 +2125,138 @@ private:
                     0, nullptr,
                     2, endBarriers);
 
+            if(timestampQueryPool != VK_NULL_HANDLE){
+                vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, 2 * currentFrame + 1);
+                timestampsWritten[currentFrame] = true;
+                timestampsPreviewed[currentFrame] = previewing;
+            }
+
         if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
         {
             throw runtime_error("failed to record command buffer");
         }
     }
 
+    // Records the ReSTIR passes that fill the reservoirs the trace pass shades primary hits with
+    void recordRestir(VkCommandBuffer commandBuffer)
+    {
+        uint32_t groupsX = (renderWidth + 31) / 32;
+        uint32_t groupsY = (renderHeight + 31) / 32;
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, restirInitialPipeline);
+        vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+
+        computeToComputeBarrier(commandBuffer);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, restirSpatialPipeline);
+        vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+
+        computeToComputeBarrier(commandBuffer);
+    }
+
+    // Records the upsample of the rendered corner of outputImage to the swapchain resolution
+    // With the upscaler on it is the EASU + RCAS pair, otherwise a bilinear filter
+    void recordUpsample(VkCommandBuffer commandBuffer)
+    {
+        uint32_t groupsX = (swapChainExtent.width + 31) / 32;
+        uint32_t groupsY = (swapChainExtent.height + 31) / 32;
+
+        computeToComputeBarrier(commandBuffer);
+        if(upscalerOn){
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, easuPipeline);
+            vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+
+            computeToComputeBarrier(commandBuffer);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, rcasPipeline);
+            vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+        }else{
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, upsamplePipeline);
+            vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+        }
+    }
+
+    // Zeroes SSBOs the shaders learn into, like the path guiding and radiance cache buffers
+    void recordSSBOClear(VkCommandBuffer commandBuffer, std::initializer_list<int> indices)
+    {
+        for(int index : indices){
+            vkCmdFillBuffer(commandBuffer, shaderStorageBuffers[index], 0, VK_WHOLE_SIZE, 0);
+        }
+
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+                            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                            0,
+                            1, &barrier,
+                            0, nullptr,
+                            0, nullptr);
+    }
+
+    // Records the pass that turns the radiance splatted by the trace pass into the guiding quadtrees
+    void recordGuidingBuild(VkCommandBuffer commandBuffer)
+    {
+        computeToComputeBarrier(commandBuffer);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, guidingBuildPipeline);
+        vkCmdDispatch(commandBuffer, (guidingCells + 63) / 64, 1, 1);
+    }
+
+    // Records the pass that resolves the samples splatted into the radiance cache and evicts stale entries
+    void recordRadianceCacheUpdate(VkCommandBuffer commandBuffer)
+    {
+        computeToComputeBarrier(commandBuffer);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, radianceCacheUpdatePipeline);
+        vkCmdDispatch(commandBuffer, (radianceCacheEntries + 63) / 64, 1, 1);
+    }
+
+    // Records the pass that traces this frame's photons from the lights and stores the caustic ones in the hash grid
+    void recordPhotons(VkCommandBuffer commandBuffer)
+    {
+        recordSSBOClear(commandBuffer, {14});
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, photonPipeline);
+        vkCmdDispatch(commandBuffer, photonsPerFrame / (32 * 32), 1, 1);
+        computeToComputeBarrier(commandBuffer);
+    }
+
+    // Records the SVGF passes: temporal accumulation, variance estimation and the a-trous iterations
+    void recordDenoiser(VkCommandBuffer commandBuffer)
+    {
+        uint32_t groupsX = (renderWidth + 31) / 32;
+        uint32_t groupsY = (renderHeight + 31) / 32;
+
+        computeToComputeBarrier(commandBuffer);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, denoiserTemporalPipeline);
+        vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+
+        computeToComputeBarrier(commandBuffer);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, denoiserVariancePipeline);
+        vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, denoiserAtrousPipeline);
+        for(int step = 0; step < denoiserIterations; step++){
+            computeToComputeBarrier(commandBuffer);
+            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                offsetof(PushConstants, denoiser_step), sizeof(int), &step);
+            vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+        }
+    }
+
+    // Makes the shader writes of a dispatch visible to the next one
+    void computeToComputeBarrier(VkCommandBuffer commandBuffer)
+    {
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+        vkCmdPipelineBarrier(commandBuffer,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0,
+                1, &barrier,
+                0, nullptr,
+                0, nullptr);
+    }
+
     // ---------------- Main draw (dispatch) call ------------------------------------------------
     void drawFrame()
     {
@@ -1311,6 +2264,9 @@ private:
 
         vkQueueWaitIdle(presentQueue);
 
+        readGpuFrameTime();
+        updateRenderScale();
+
         uint32_t imageIndex;
         VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
 
@@ -1410,10 +2366,10 @@ private:
     }
 
     void recreateFrameAccumulationBuffers(int width, int height){
-        vkDestroyBuffer(device, colorAccumulationBuffer, nullptr);
-        vkFreeMemory(device, colorAccumulationBufferMemory, nullptr);
-        vkDestroyBuffer(device, sampleCountBuffer, nullptr);
-        vkFreeMemory(device, sampleCountBufferMemory, nullptr);
+        for(int i = 0; i < numFrameAccumBuffers; i++){
+            vkDestroyBuffer(device, frameAccumBuffers[i], nullptr);
+            vkFreeMemory(device, frameAccumBufferMemory[i], nullptr);
+        }
 
         createFrameAccumulationBuffers(width,height);
         createDescriptorSetsFrameAccumulation(width,height);
@@ -1422,6 +2378,11 @@ private:
 
     // ---------------- Push constants update per each frame ------------------------------------------------
     void updatePushConstantsPre(){
+        // The preview covers the camera motion and a short hold after it, then the path tracer resumes
+        if(cameraMoved) lastCameraMoveTime = glfwGetTime();
+        previewing = previewMode != PASS_TRACE && !staticRenderMode && lastCameraMoveTime >= 0.0
+                     && glfwGetTime() - lastCameraMoveTime < previewHoldTime;
+
         pushConstants.time = lastFrame;
         pushConstants.frameCount = frameCount;
         pushConstants.total_lights = scene.total_lights;
@@ -1434,11 +2395,47 @@ private:
         }
         pushConstants.total_spheres = scene.total_spheres;
         pushConstants.total_triangles = scene.total_triangles;
+        pushConstants.total_parallelograms = scene.total_parallelograms;
+        pushConstants.total_disks = scene.total_disks;
+        pushConstants.total_boxes = scene.total_boxes;
+        pushConstants.total_planes = scene.total_planes;
+        pushConstants.total_primitives = scene.total_primitives;
         pushConstants.total_meshes = scene.total_meshes;
+        pushConstants.light_samples = lightSamplesPerVertex;
+        pushConstants.features = 0;
+        if(denoiserOn) pushConstants.features |= FEATURE_DENOISER;
+        if(cameraMoved || previewedSinceTrace) pushConstants.features |= FEATURE_CAMERA_MOVED;
+        if(restirOn) pushConstants.features |= FEATURE_RESTIR;
+        if(guidingOn) pushConstants.features |= FEATURE_GUIDING;
+        if(radianceCacheOn) pushConstants.features |= FEATURE_RADIANCE_CACHE;
+        if(photonsOn) pushConstants.features |= FEATURE_PHOTONS;
+        pushConstants.frame_index = frameIndex;
+        pushConstants.denoiser_step = 0;
+        pushConstants.denoiser_iterations = denoiserIterations;
+        pushConstants.environment_light = scene.environment_light;
+        pushConstants.render_width = renderWidth;
+        pushConstants.render_height = renderHeight;
+        if(renderScaleChanged) pushConstants.features |= FEATURE_RESIZED;
+        // The gather radius shrinks while the image converges and starts over when it is reset
+        if(resetFrameAccumulation || cameraMoved || !frameAccumulationOn) photonIteration = 0;
+        pushConstants.photons_per_frame = photonsPerFrame;
+        pushConstants.photon_iteration = photonIteration++;
     }
 
     void updatePushConstantsPost(){
-        resetFrameAccumulation = false;
+        cameraMoved = false;
+        // Previews leave the ping-pong halves alone, the next traced frame reprojects the last traced one
+        // and still has to see the resets and resizes requested meanwhile
+        if(previewing){
+            previewedSinceTrace = true;
+        }else{
+            resetFrameAccumulation = false;
+            resetGuiding = false;
+            resetRadianceCache = false;
+            renderScaleChanged = false;
+            previewedSinceTrace = false;
+            frameIndex++;
+        }
     }
     
     
@@ -1475,7 +2472,7 @@ private:
 
         ubo.camera.viewInv = glm::inverse(ubo.camera.view); 
         
-        float aspectRatio = swapChainExtent.width/swapChainExtent.height;
+        float aspectRatio = float(swapChainExtent.width)/float(swapChainExtent.height);
         
         ubo.camera.proj = glm::perspective(
             glm::radians(fov), 
@@ -1487,7 +2484,14 @@ private:
 
         ubo.camera.projInv = glm::inverse(ubo.camera.proj);
 
-        ubo.camera.viewproj = ubo.camera.view * ubo.camera.proj;
+        ubo.camera.viewproj = ubo.camera.proj * ubo.camera.view;
+
+        // First frame has no history, reprojecting with the current camera is a no-op
+        ubo.camera.prevViewproj = frameIndex == 0 ? ubo.camera.viewproj : prevViewproj;
+        if(!previewing) prevViewproj = ubo.camera.viewproj;
+
+        ubo.sceneMin = glm::vec4(scene.boundsMin, 0.0);
+        ubo.sceneMax = glm::vec4(scene.boundsMax, 0.0);
 
         ubo.camera.position = cameraPos;
 
@@ -1554,12 +2558,54 @@ private:
     // ---------------- SSBO creation ------------------------------------------------
     void createShaderStorageBuffers(){
         createSSBOVector(0,scene.sphereVec);
-        createSSBOVector(1,scene.materialVec);
+        createSSBOVector(1,scene.packedMaterialVec);
         createSSBOVector(2,scene.lightsVec);
         createSSBOVector(3,scene.triangleVec);
         createSSBOVector(4,scene.vertexVec);
         createSSBOVector(5,scene.indexVec);
         createSSBOVector(6,scene.meshVec);
+        createSSBOVector(7,scene.lightAliasVec);
+        createZeroedSSBO(8, guidingTrainSize());
+        createZeroedSSBO(9, guidingTreeSize());
+        createSSBOVector(10,scene.environmentVec);
+        createSSBOVector(11,scene.environmentMarginalVec);
+        createZeroedSSBO(12, radianceCacheEntries * radianceCacheEntrySize);
+        createZeroedSSBO(13, photonsPerFrame * photonSize);
+        createZeroedSSBO(14, (1 + photonGridBuckets) * sizeof(uint32_t));
+        createSSBOVector(15,scene.bsdfLutVec);
+        createSSBOVector(16,scene.parallelogramVec);
+        createSSBOVector(17,scene.diskVec);
+        createSSBOVector(18,scene.boxVec);
+        createSSBOVector(19,scene.planeVec);
+        createSSBOVector(20,scene.meshEmitterCdfVec);
+        createSSBOVector(21,scene.geometryVec);
+        createSSBOVector(22,scene.quantizedVec);
+        createSSBOVector(23,scene.primitiveRefVec);
+        createSSBOVector(24,scene.bvhVec);
+        createZeroedSSBO(25, 2 * sizeof(uint32_t));
+        createSSBOVector(26,scene.rayQueryRefVec);
+    }
+
+    // Creates a SSBO that only the shaders fill, starting as zeros
+    void createZeroedSSBO(int index, VkDeviceSize bufferSize){
+        if (shaderStorageBuffers[index] != VK_NULL_HANDLE) {
+            vkDestroyBuffer(device, shaderStorageBuffers[index], nullptr);
+            vkFreeMemory(device, shaderStorageBufferMemory[index], nullptr);
+        }
+
+        createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, shaderStorageBuffers[index], shaderStorageBufferMemory[index]);
+        initializeBufferWithZeros(shaderStorageBuffers[index], bufferSize);
+    }
+
+    // Fixed point radiance splatted into every leaf of every cell
+    VkDeviceSize guidingTrainSize(){
+        return VkDeviceSize(guidingCells) * guidingLeaves * sizeof(uint32_t);
+    }
+
+    // Every node of the quadtree of every cell
+    VkDeviceSize guidingTreeSize(){
+        return VkDeviceSize(guidingCells) * guidingNodes * sizeof(float);
     }
 
     template <typename T>
@@ -1592,17 +2638,250 @@ private:
         vkFreeMemory(device,stagingBufferMemory,nullptr);
     }
 
+    // Overwrites the contents of an existing SSBO, dataVector must have the size it was created with
+    template <typename T>
+    void updateSSBOVector(int index, vector<T> dataVector){
+        VkDeviceSize bufferSize = sizeof(T) * dataVector.size();
+
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+            stagingBuffer, stagingBufferMemory);
+
+        void* data;
+        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+            memcpy(data, dataVector.data(), (size_t)bufferSize);
+        vkUnmapMemory(device, stagingBufferMemory);
+
+        copyBuffer(stagingBuffer, shaderStorageBuffers[index], bufferSize);
+
+        vkDestroyBuffer(device,stagingBuffer,nullptr);
+        vkFreeMemory(device,stagingBufferMemory,nullptr);
+    }
+
+    // ---------------- Ray query acceleration structures ------------------------------------------------
+    // Extension functions are not exported by the loader
+    void loadRayQueryFunctions()
+    {
+        pfnCreateAccelerationStructure = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(
+            vkGetDeviceProcAddr(device, "vkCreateAccelerationStructureKHR"));
+        pfnDestroyAccelerationStructure = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(
+            vkGetDeviceProcAddr(device, "vkDestroyAccelerationStructureKHR"));
+        pfnGetAccelerationStructureBuildSizes = reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(
+            vkGetDeviceProcAddr(device, "vkGetAccelerationStructureBuildSizesKHR"));
+        pfnCmdBuildAccelerationStructures = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(
+            vkGetDeviceProcAddr(device, "vkCmdBuildAccelerationStructuresKHR"));
+        pfnGetAccelerationStructureDeviceAddress = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(
+            vkGetDeviceProcAddr(device, "vkGetAccelerationStructureDeviceAddressKHR"));
+
+        if(!pfnCreateAccelerationStructure || !pfnDestroyAccelerationStructure || !pfnGetAccelerationStructureBuildSizes
+           || !pfnCmdBuildAccelerationStructures || !pfnGetAccelerationStructureDeviceAddress)
+            throw runtime_error("failed to load the acceleration structure functions");
+    }
+
+    // One BLAS with the triangles of the primitive stream, one with the AABBs of the rest and a TLAS over both
+    // The instance custom index is where the primitives of its BLAS start in scene.rayQueryRefVec
+    void createAccelerationStructures()
+    {
+        uint32_t triangleCount = scene.rayQueryVertexVec.size() / 3;
+        uint32_t aabbCount = scene.rayQueryAabbVec.size();
+        vector<VkAccelerationStructureInstanceKHR> instances;
+        auto addInstance = [&](const AccelerationStructure& blas, uint32_t customIndex){
+            VkAccelerationStructureInstanceKHR instance{};
+            instance.transform.matrix[0][0] = 1.0f;
+            instance.transform.matrix[1][1] = 1.0f;
+            instance.transform.matrix[2][2] = 1.0f;
+            instance.instanceCustomIndex = customIndex;
+            instance.mask = 0xFF;
+            instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+            instance.accelerationStructureReference = blas.address;
+            instances.push_back(instance);
+        };
+
+        if(triangleCount > 0){
+            VkBuffer vertexBuffer;
+            VkDeviceMemory vertexBufferMemory;
+            createBuildInputBuffer(scene.rayQueryVertexVec, vertexBuffer, vertexBufferMemory);
+
+            VkAccelerationStructureGeometryKHR geometry{};
+            geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+            geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+            geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+            geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+            geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+            geometry.geometry.triangles.vertexData.deviceAddress = bufferAddress(vertexBuffer);
+            geometry.geometry.triangles.vertexStride = sizeof(glm::vec3);
+            geometry.geometry.triangles.maxVertex = 3 * triangleCount - 1;
+            geometry.geometry.triangles.indexType = VK_INDEX_TYPE_NONE_KHR;
+
+            blasTriangles = buildAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, geometry, triangleCount);
+            addInstance(blasTriangles, 0);
+
+            vkDestroyBuffer(device, vertexBuffer, nullptr);
+            vkFreeMemory(device, vertexBufferMemory, nullptr);
+        }
+
+        if(aabbCount > 0){
+            VkBuffer aabbBuffer;
+            VkDeviceMemory aabbBufferMemory;
+            createBuildInputBuffer(scene.rayQueryAabbVec, aabbBuffer, aabbBufferMemory);
+
+            VkAccelerationStructureGeometryKHR geometry{};
+            geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+            geometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
+            geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+            geometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
+            geometry.geometry.aabbs.data.deviceAddress = bufferAddress(aabbBuffer);
+            geometry.geometry.aabbs.stride = sizeof(Aabb);
+
+            blasAabbs = buildAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, geometry, aabbCount);
+            addInstance(blasAabbs, triangleCount);
+
+            vkDestroyBuffer(device, aabbBuffer, nullptr);
+            vkFreeMemory(device, aabbBufferMemory, nullptr);
+        }
+
+        // Built even without instances, the descriptor needs a TLAS. Buffers can't be 0 bytes
+        uint32_t instanceCount = instances.size();
+        if(instances.empty()) instances.push_back({});
+        VkBuffer instanceBuffer;
+        VkDeviceMemory instanceBufferMemory;
+        createBuildInputBuffer(instances, instanceBuffer, instanceBufferMemory);
+
+        VkAccelerationStructureGeometryKHR geometry{};
+        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+        geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+        geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+        geometry.geometry.instances.data.deviceAddress = bufferAddress(instanceBuffer);
+
+        tlas = buildAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, geometry, instanceCount);
+
+        vkDestroyBuffer(device, instanceBuffer, nullptr);
+        vkFreeMemory(device, instanceBufferMemory, nullptr);
+    }
+
+    // Creates and builds an acceleration structure of a single geometry, waits for the build to finish
+    AccelerationStructure buildAccelerationStructure(VkAccelerationStructureTypeKHR type,
+                                                     const VkAccelerationStructureGeometryKHR& geometry, uint32_t primitiveCount)
+    {
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = type;
+        buildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &geometry;
+
+        VkAccelerationStructureBuildSizesInfoKHR sizes{};
+        sizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        pfnGetAccelerationStructureBuildSizes(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &primitiveCount, &sizes);
+
+        AccelerationStructure as;
+        createBuffer(sizes.accelerationStructureSize,
+            VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, as.buffer, as.memory);
+
+        VkAccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        createInfo.buffer = as.buffer;
+        createInfo.size = sizes.accelerationStructureSize;
+        createInfo.type = type;
+
+        if (pfnCreateAccelerationStructure(device, &createInfo, nullptr, &as.handle) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to create acceleration structure");
+        }
+
+        // Over-allocated so the scratch address can be rounded up to the alignment the device asks for
+        VkBuffer scratchBuffer;
+        VkDeviceMemory scratchBufferMemory;
+        createBuffer(max(sizes.buildScratchSize, VkDeviceSize(1)) + scratchAlignment - 1,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratchBuffer, scratchBufferMemory);
+
+        buildInfo.dstAccelerationStructure = as.handle;
+        VkDeviceAddress scratchAddress = bufferAddress(scratchBuffer);
+        buildInfo.scratchData.deviceAddress = (scratchAddress + scratchAlignment - 1) / scratchAlignment * scratchAlignment;
+
+        VkAccelerationStructureBuildRangeInfoKHR range{};
+        range.primitiveCount = primitiveCount;
+        const VkAccelerationStructureBuildRangeInfoKHR* ranges = &range;
+
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        pfnCmdBuildAccelerationStructures(commandBuffer, 1, &buildInfo, &ranges);
+        endSingleTimeCommands(commandBuffer);
+
+        vkDestroyBuffer(device, scratchBuffer, nullptr);
+        vkFreeMemory(device, scratchBufferMemory, nullptr);
+
+        VkAccelerationStructureDeviceAddressInfoKHR addressInfo{};
+        addressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        addressInfo.accelerationStructure = as.handle;
+        as.address = pfnGetAccelerationStructureDeviceAddress(device, &addressInfo);
+        return as;
+    }
+
+    void destroyAccelerationStructures()
+    {
+        for(AccelerationStructure* as : {&blasTriangles, &blasAabbs, &tlas}){
+            if(as->handle == VK_NULL_HANDLE) continue;
+            pfnDestroyAccelerationStructure(device, as->handle, nullptr);
+            vkDestroyBuffer(device, as->buffer, nullptr);
+            vkFreeMemory(device, as->memory, nullptr);
+            *as = AccelerationStructure{};
+        }
+    }
+
+    // Host visible buffer an acceleration structure build reads from
+    template <typename T>
+    void createBuildInputBuffer(const vector<T>& dataVector, VkBuffer& buffer, VkDeviceMemory& bufferMemory)
+    {
+        VkDeviceSize bufferSize = sizeof(T) * dataVector.size();
+        createBuffer(bufferSize,
+            VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, bufferMemory);
+
+        void* data;
+        vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &data);
+            memcpy(data, dataVector.data(), (size_t)bufferSize);
+        vkUnmapMemory(device, bufferMemory);
+    }
+
+    VkDeviceAddress bufferAddress(VkBuffer buffer)
+    {
+        VkBufferDeviceAddressInfo addressInfo{};
+        addressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+        addressInfo.buffer = buffer;
+        return vkGetBufferDeviceAddress(device, &addressInfo);
+    }
+
     // ---------------- Frame accumulation buffers creation ------------------------------------------------
     void createFrameAccumulationBuffers(int width, int height){
-        VkDeviceSize imageSizeColor = width * height * sizeof(glm::vec4);
-        createBuffer(imageSizeColor, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, colorAccumulationBuffer, colorAccumulationBufferMemory);
-        initializeBufferWithZeros(colorAccumulationBuffer,imageSizeColor);
-        
-        VkDeviceSize imageSize = width * height * sizeof(uint32_t);
-        createBuffer(imageSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, sampleCountBuffer, sampleCountBufferMemory);        
-        initializeBufferWithZeros(sampleCountBuffer,imageSize);
+        for(int i = 0; i < numFrameAccumBuffers; i++){
+            VkDeviceSize size = frameAccumBufferSize(i,width,height);
+            createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frameAccumBuffers[i], frameAccumBufferMemory[i]);
+            initializeBufferWithZeros(frameAccumBuffers[i],size);
+        }
+    }
+
+    // Size in bytes of each per pixel buffer, must match the set 2 bindings of common.glsl
+    VkDeviceSize frameAccumBufferSize(int index, int width, int height){
+        VkDeviceSize pixels = width * height;
+        switch(index){
+            case 0: return 2 * pixels * sizeof(glm::vec4);      // Accumulated colors, current and previous frame
+            case 1: return 2 * pixels * sizeof(uint32_t);       // Sample counts, current and previous frame
+            case 2: return 2 * pixels * 2 * sizeof(glm::vec4);  // G-buffer, current and previous frame
+            case 3: return pixels * sizeof(glm::vec4);          // Colors traced this frame
+            case 4: return 2 * pixels * 2 * sizeof(glm::vec4);  // Denoiser history, current and previous frame
+            case 5: return 2 * pixels * sizeof(glm::vec4);      // Denoiser a-trous ping-pong
+            case 6: return 3 * pixels * 2 * sizeof(glm::vec4);  // ReSTIR reservoirs, spatial input and final of current and previous frame
+            case 7: return pixels * sizeof(uint32_t);           // Upsampled display pixels, copied to the swapchain
+            case 8: return pixels * sizeof(uint32_t);           // EASU output before sharpening
+            default: throw runtime_error("unknown frame accumulation buffer");
+        }
     }
 
 
@@ -1627,7 +2906,7 @@ private:
             throw runtime_error("failed to create descriptor set layout per frame");
         }
 
-        array<VkDescriptorSetLayoutBinding, numSSBO+1> layoutBindingsB{};
+        vector<VkDescriptorSetLayoutBinding> layoutBindingsB(numSSBO+1);
 
         layoutBindingsB[0].binding = 0;
         layoutBindingsB[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
@@ -1643,6 +2922,16 @@ private:
             layoutBindingsB[i].pImmutableSamplers = nullptr;
         }
 
+        if(rayQuerySupported){
+            VkDescriptorSetLayoutBinding tlasBinding{};
+            tlasBinding.binding = 1+numSSBO;
+            tlasBinding.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+            tlasBinding.descriptorCount = 1;
+            tlasBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            tlasBinding.pImmutableSamplers = nullptr;
+            layoutBindingsB.push_back(tlasBinding);
+        }
+
         VkDescriptorSetLayoutCreateInfo layoutInfoGlobal{};
         layoutInfoGlobal.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
         layoutInfoGlobal.bindingCount = static_cast<uint32_t>(layoutBindingsB.size());
@@ -1653,9 +2942,9 @@ private:
             throw runtime_error("failed to create descriptor set layout global");
         }
 
-        array<VkDescriptorSetLayoutBinding, 2> layoutBindingsC{};
+        array<VkDescriptorSetLayoutBinding, numFrameAccumBuffers> layoutBindingsC{};
 
-        for(int i = 0; i<2; i++){
+        for(int i = 0; i<numFrameAccumBuffers; i++){
             layoutBindingsC[i].binding = i;
             layoutBindingsC[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
             layoutBindingsC[i].descriptorCount = 1;
@@ -1677,7 +2966,7 @@ private:
 
     void createDescriptorPool()
     {
-        array<VkDescriptorPoolSize, 1 + 1+numSSBO + 2> poolSizes{};
+        vector<VkDescriptorPoolSize> poolSizes(1 + 1+numSSBO + numFrameAccumBuffers);
 
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
@@ -1690,6 +2979,10 @@ private:
             poolSizes[i].descriptorCount = 1;
         }
 
+        if(rayQuerySupported){
+            poolSizes.push_back({VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1});
+        }
+
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         poolInfo.poolSizeCount = poolSizes.size();
@@ -1788,7 +3081,7 @@ private:
         ssboInfos[0].range = sizeof(Sphere) * scene.sphereVec.size();
 
         // Materials SSBO
-        ssboInfos[1].range = sizeof(Material) * scene.materialVec.size();
+        ssboInfos[1].range = sizeof(PackedMaterial) * scene.packedMaterialVec.size();
 
         // Lights SSBO
         ssboInfos[2].range = sizeof(Light) * scene.lightsVec.size();
@@ -1804,6 +3097,54 @@ private:
 
         // Mesh info SSBO
         ssboInfos[6].range = sizeof(MeshInfo) * scene.meshVec.size();
+
+        // Light alias table SSBO
+        ssboInfos[7].range = sizeof(LightAlias) * scene.lightAliasVec.size();
+
+        // Path guiding training and quadtree SSBOs
+        ssboInfos[8].range = guidingTrainSize();
+        ssboInfos[9].range = guidingTreeSize();
+
+        // Environment map texels and row CDF SSBOs
+        ssboInfos[10].range = sizeof(glm::vec4) * scene.environmentVec.size();
+        ssboInfos[11].range = sizeof(float) * scene.environmentMarginalVec.size();
+
+        // Radiance cache SSBO
+        ssboInfos[12].range = radianceCacheEntries * radianceCacheEntrySize;
+
+        // Photon map SSBOs, the grid starts with the photon counter
+        ssboInfos[13].range = photonsPerFrame * photonSize;
+        ssboInfos[14].range = (1 + photonGridBuckets) * sizeof(uint32_t);
+
+        // BSDF lookup table SSBO
+        ssboInfos[15].range = sizeof(glm::vec2) * scene.bsdfLutVec.size();
+
+        // Analytic primitives SSBOs
+        ssboInfos[16].range = sizeof(Parallelogram) * scene.parallelogramVec.size();
+        ssboInfos[17].range = sizeof(Disk) * scene.diskVec.size();
+        ssboInfos[18].range = sizeof(Box) * scene.boxVec.size();
+        ssboInfos[19].range = sizeof(Plane) * scene.planeVec.size();
+
+        // Emissive meshes triangle CDF SSBO
+        ssboInfos[20].range = sizeof(float) * scene.meshEmitterCdfVec.size();
+
+        // Primitive stream geometry SSBO
+        ssboInfos[21].range = sizeof(glm::vec4) * scene.geometryVec.size();
+
+        // Quantized vertex SSBO
+        ssboInfos[22].range = sizeof(uint16_t) * scene.quantizedVec.size();
+
+        // Primitive stream references SSBO
+        ssboInfos[23].range = sizeof(PrimitiveRef) * scene.primitiveRefVec.size();
+
+        // BVH nodes SSBO
+        ssboInfos[24].range = sizeof(BvhNode) * scene.bvhVec.size();
+
+        // Ray counter SSBO, low and high words
+        ssboInfos[25].range = 2 * sizeof(uint32_t);
+
+        // Ray query primitive to stream index SSBO
+        ssboInfos[26].range = sizeof(uint32_t) * scene.rayQueryRefVec.size();
         
 
         array<VkWriteDescriptorSet, 1+numSSBO> descriptorWrites{};
@@ -1827,23 +3168,38 @@ private:
         }
 
         vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+
+        // TLAS of the ray query backend, after the SSBOs
+        if(rayQuerySupported){
+            VkWriteDescriptorSetAccelerationStructureKHR tlasInfo{};
+            tlasInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+            tlasInfo.accelerationStructureCount = 1;
+            tlasInfo.pAccelerationStructures = &tlas.handle;
+
+            VkWriteDescriptorSet tlasWrite{};
+            tlasWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            tlasWrite.pNext = &tlasInfo;
+            tlasWrite.dstSet = descriptorSetGlobal;
+            tlasWrite.dstBinding = 1+numSSBO;
+            tlasWrite.dstArrayElement = 0;
+            tlasWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+            tlasWrite.descriptorCount = 1;
+
+            vkUpdateDescriptorSets(device, 1, &tlasWrite, 0, nullptr);
+        }
     }
 
     void createDescriptorSetsFrameAccumulation(int width, int height){
-        vector<VkDescriptorBufferInfo> ssboInfos(2);
-
-        // Spheres SSBO
-        ssboInfos[0].buffer = colorAccumulationBuffer;
-        ssboInfos[0].offset = 0;
-        ssboInfos[0].range = width * height * sizeof(glm::vec4);
+        vector<VkDescriptorBufferInfo> ssboInfos(numFrameAccumBuffers);
 
-        // Materials SSBO
-        ssboInfos[1].buffer = sampleCountBuffer;
-        ssboInfos[1].offset = 0;
-        ssboInfos[1].range = width * height * sizeof(uint32_t);
+        for(int i = 0; i < numFrameAccumBuffers; i++){
+            ssboInfos[i].buffer = frameAccumBuffers[i];
+            ssboInfos[i].offset = 0;
+            ssboInfos[i].range = frameAccumBufferSize(i,width,height);
+        }
 
 
-        array<VkWriteDescriptorSet, 2> descriptorWrites{};
+        array<VkWriteDescriptorSet, numFrameAccumBuffers> descriptorWrites{};
         for(int i = 0; i < descriptorWrites.size(); i++){
             descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
             descriptorWrites[i].dstSet = descriptorSetFrameAccum;
@@ -2093,6 +3449,14 @@ private:
         allocInfo.allocationSize = memRequirements.size;
         allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
 
+        // Buffers read through their device address, like the acceleration structure inputs
+        VkMemoryAllocateFlagsInfo allocFlagsInfo{};
+        allocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+        allocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+        if(usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT){
+            allocInfo.pNext = &allocFlagsInfo;
+        }
+
         if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
         {
             throw std::runtime_error("failed to allocate buffer memory");
@@ -2,8 +2,10 @@
 #include <random>
 #include <algorithm>
 #include "tinygltf/loader.hpp"
+#include "tinygltf/stb_image.h"
 #include <glm/gtx/euler_angles.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 
 
 int randomInt(int min, int max) {
@@ -27,11 +29,30 @@ Scene::Scene(){
     lightsVec.push_back({});
     sphereVec.push_back({});
     triangleVec.push_back({});
+    parallelogramVec.push_back({});
+    diskVec.push_back({});
+    boxVec.push_back({});
+    planeVec.push_back({});
     meshVec.push_back({});
+    meshEmitterCdfVec.push_back(0.0);
     vertexVec.push_back({});
     indexVec.push_back(0);
+    quantizedVec.push_back(0);
+    environmentVec.push_back({});
+    environmentMarginalVec.push_back(0.0);
 
     createCornellBox();
+
+    buildLightAliasTable();
+    computeBounds();
+    buildBsdfLut();
+    buildTriangleTransforms();
+    buildPrimitiveStream();
+
+    // A scene with only float or only quantized meshes leaves the other vertex buffer empty
+    if(vertexVec.empty()) vertexVec.push_back({});
+    // The shader reads the 16 bit positions two at a time as uints
+    while(quantizedVec.size() < 2 || quantizedVec.size() % 2 != 0) quantizedVec.push_back(0);
 }
 
 void Scene::createPreset1(){
@@ -55,6 +76,9 @@ void Scene::createPreset1(){
     });
     */
 
+    // HDR environment, file inside ASSETS_DIRECTORY
+    addEnvironment("sky.hdr", glm::vec3(1.0), 1.0);
+
     // Moon
     /*
     addLight({
@@ -232,10 +256,10 @@ void Scene::createPreset1(){
     });
 
     
-    // Ground sphere
-    addSphere({
-        pos: glm::vec3(0.0,-1000.0,-10.0),
-        r: 999.0,
+    // Ground
+    addPlane({
+        normal: glm::vec3(0.0,1.0,0.0),
+        offset: -1.0,
         mat: ground
     });
 
@@ -314,6 +338,23 @@ void Scene::createPreset1(){
         mat: blue_ligth
     });
 
+    // Round mirror standing on the ground, tilted towards the camera
+    addDisk({
+        center: glm::vec3(-4.5,0.3,-11.0),
+        r: 1.3,
+        normal: glm::vec3(0.4,0.0,1.0),
+        mat: mirror
+    });
+
+    // Box resting on the ground, turned 30 degrees around the vertical
+    addBox({
+        center: glm::vec3(4.5,-0.4,-8.0),
+        mat: redMatte,
+        axis_x: glm::vec4(0.866,0.0,-0.5,0.6),
+        axis_y: glm::vec4(0.0,1.0,0.0,0.6),
+        axis_z: glm::vec4(0.5,0.0,0.866,0.6)
+    });
+
     
 
     addTriangle({
@@ -333,7 +374,7 @@ void Scene::createPreset1(){
     Model teapot = {
         file_name: "teapot.glb",
         pos: glm::vec3(0.0,-1.0,10.0),
-        pitch: 90.0,
+        pitch: 0.0,
         yaw: 0.0,
         roll: 0.0,
         scale: 1.0,
@@ -681,7 +722,7 @@ void Scene::createCornellBox(){
     Model star = {
         file_name: "star.glb",
         pos: glm::vec3(3.5,4.0,3.1),
-        pitch: 00.0,
+        pitch: 90.0,
         yaw: 18.0,
         roll: 180.0,
         scale: 0.1,
@@ -715,12 +756,14 @@ void Scene::printLight(const Light& light) {
 
 void Scene::addSphere(Sphere s){
     // If it emmits light add it to the list
+    s.light = -1;
     if(materialVec[s.mat].emission_color.a > 0.0){
         addLight({
             pos_angle_aux: glm::vec4(s.pos,s.r),
             color_str: materialVec[s.mat].emission_color,
             type: SPHERE 
         });
+        s.light = total_lights-1;
     }
 
     if(total_spheres == 0) sphereVec.pop_back();
@@ -744,7 +787,24 @@ int Scene::addMaterial(Material m){
     if(m.ior == 1.0) m.ior = 1.00001;
     m.trs_weight = glm::clamp(m.trs_weight,float(0.0),float(1.0));
 
+    // The dielectric reflectance is the same seen from either side, (1-ri)/(1+ri) only flips sign when ri is inverted
+    float ri = m.ior * glm::mix(0.0f, 2.0f, m.specular_tint.a);
+    float dielectric_F0 = (1.0f - ri) / (1.0f + ri);
+    glm::vec3 F0 = glm::mix(glm::vec3(dielectric_F0 * dielectric_F0), glm::vec3(m.albedo), m.metallic);
+    m.f0_alpha = glm::vec4(F0, m.roughness * m.roughness);
+
     materialVec.push_back(m);
+    // Every color is already clamped to [0,1] so unorm8 holds it
+    packedMaterialVec.push_back({
+        albedo: glm::packUnorm4x8(m.albedo),
+        subsurface: glm::packUnorm4x8(m.subsurface),
+        specular_tint: glm::packUnorm4x8(m.specular_tint),
+        f0_metallic: glm::packUnorm4x8(glm::vec4(F0, m.metallic)),
+        emission_trs: glm::packUnorm4x8(glm::vec4(glm::vec3(m.emission_color), m.trs_weight)),
+        roughness_alpha: glm::packHalf2x16(glm::vec2(m.roughness, m.f0_alpha.a)),
+        ior: m.ior,
+        emission_strength: m.emission_color.a
+    });
     return materialVec.size()-1;
 }
 
@@ -762,10 +822,548 @@ void Scene::addLight(Light l){
     lights_strength_sum += l.color_str.a;
 }
 
+// Loads an equirectangular HDR image as the sky and registers it as a light
+// The texels are importance sampled by luminance with a marginal CDF over the rows and a conditional CDF per row
+// scale multiplies the radiance of the image, strength is the weight of the light when picking lights
+void Scene::addEnvironment(const std::string& file_name, glm::vec3 scale, float strength){
+    int width, height, channels;
+    float* pixels = stbi_loadf((ASSETS_DIRECTORY+file_name).c_str(), &width, &height, &channels, 3);
+    if(pixels == nullptr){
+        std::cerr<<"Error loading environment "<<ASSETS_DIRECTORY+file_name<<": "<<stbi_failure_reason()<<std::endl;
+        return;
+    }
+    std::cout<<"Environment "<<ASSETS_DIRECTORY+file_name<<" loaded successfully! "<<width<<"x"<<height<<std::endl;
+
+    environmentVec.assign(width * height, glm::vec4(0.0));
+    environmentMarginalVec.assign(height, 0.0);
+
+    // Texels are weighted by their luminance and by sin(theta), the rows near the poles cover less solid angle
+    double total = 0.0;
+    std::vector<double> rowSums(height);
+    for(int y = 0; y < height; y++){
+        float sinTheta = glm::sin(glm::pi<float>() * (y + 0.5f) / height);
+        double rowSum = 0.0;
+        for(int x = 0; x < width; x++){
+            const float* p = pixels + 3 * (y * width + x);
+            glm::vec3 radiance = glm::vec3(p[0], p[1], p[2]);
+            rowSum += glm::dot(radiance, glm::vec3(0.2126, 0.7152, 0.0722)) * sinTheta;
+            environmentVec[y * width + x] = glm::vec4(radiance, rowSum);
+        }
+        for(int x = 0; x < width; x++){
+            glm::vec4& texel = environmentVec[y * width + x];
+            texel.a = rowSum > 0.0 ? texel.a / rowSum : float(x + 1) / width;
+        }
+        rowSums[y] = rowSum;
+        total += rowSum;
+    }
+    double accumulated = 0.0;
+    for(int y = 0; y < height; y++){
+        accumulated += rowSums[y];
+        environmentMarginalVec[y] = total > 0.0 ? accumulated / total : float(y + 1) / height;
+    }
+    // Guard the last entries against rounding so every search ends inside the image
+    environmentMarginalVec[height - 1] = 1.0;
+    for(int y = 0; y < height; y++) environmentVec[y * width + width - 1].a = 1.0;
+
+    stbi_image_free(pixels);
+
+    // The sampling pdf needs the integral of the weights
+    environment_light = lightsVec.size();
+    if(total_lights == 0) environment_light = 0;
+    addLight({
+        pos_angle_aux: glm::vec4(width, height, total, 0.0),
+        color_str: glm::vec4(scale, strength),
+        type: ENVIRONMENT
+    });
+}
+
+// Spheres bigger than this are used as ground planes, they would stretch the bounds for nothing
+const float boundsMaxSphereRadius = 100.0;
+
+void Scene::computeBounds(){
+    boundsMin = glm::vec3(INFINITY);
+    boundsMax = glm::vec3(-INFINITY);
+
+    for(int i = 0; i < total_spheres; i++){
+        const Sphere& s = sphereVec[i];
+        if(s.r > boundsMaxSphereRadius) continue;
+        boundsMin = glm::min(boundsMin, s.pos - glm::vec3(s.r));
+        boundsMax = glm::max(boundsMax, s.pos + glm::vec3(s.r));
+    }
+    for(int i = 0; i < total_triangles; i++){
+        const Triangle& t = triangleVec[i];
+        boundsMin = glm::min(boundsMin, glm::min(t.v0, glm::min(t.v1, t.v2)));
+        boundsMax = glm::max(boundsMax, glm::max(t.v0, glm::max(t.v1, t.v2)));
+    }
+    for(int i = 0; i < total_parallelograms; i++){
+        const Parallelogram& p = parallelogramVec[i];
+        glm::vec3 opposite = p.corner + p.edge1 + p.edge2;
+        boundsMin = glm::min(glm::min(boundsMin, p.corner), glm::min(opposite, glm::min(p.corner + p.edge1, p.corner + p.edge2)));
+        boundsMax = glm::max(glm::max(boundsMax, p.corner), glm::max(opposite, glm::max(p.corner + p.edge1, p.corner + p.edge2)));
+    }
+    for(int i = 0; i < total_disks; i++){
+        const Disk& d = diskVec[i];
+        boundsMin = glm::min(boundsMin, d.center - glm::vec3(d.r));
+        boundsMax = glm::max(boundsMax, d.center + glm::vec3(d.r));
+    }
+    for(int i = 0; i < total_boxes; i++){
+        const Box& b = boxVec[i];
+        glm::vec3 extent = glm::abs(glm::vec3(b.axis_x) * b.axis_x.w) + glm::abs(glm::vec3(b.axis_y) * b.axis_y.w) + glm::abs(glm::vec3(b.axis_z) * b.axis_z.w);
+        boundsMin = glm::min(boundsMin, b.center - extent);
+        boundsMax = glm::max(boundsMax, b.center + extent);
+    }
+    // Planes are infinite, like the ground spheres they are left out
+    for(int m = 0; m < total_meshes; m++){
+        for(uint32_t i = meshVec[m].index_start; i < meshVec[m].index_end; i++){
+            glm::vec3 p = meshVertex(meshVec[m], indexVec[i]);
+            boundsMin = glm::min(boundsMin, p);
+            boundsMax = glm::max(boundsMax, p);
+        }
+    }
+
+    // Empty scene, any box works
+    if(boundsMin.x > boundsMax.x){
+        boundsMin = glm::vec3(-1.0);
+        boundsMax = glm::vec3(1.0);
+    }
+}
+
+std::vector<LightAlias> buildAliasTable(const std::vector<float>& weights){
+    int n = weights.size();
+    double sum = 0.0;
+    for(float w : weights) sum += w;
+    std::vector<LightAlias> table(n, {prob: 1.0, alias: 0, pdf: 0.0});
+    if(n == 0 || sum <= 0.0) return table;
+
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for(int i = 0; i < n; i++){
+        double pdf = weights[i] / sum;
+        table[i].pdf = pdf;
+        table[i].alias = i;
+        scaled[i] = pdf * n;
+        if(scaled[i] < 1.0) small.push_back(i);
+        else large.push_back(i);
+    }
+
+    while(!small.empty() && !large.empty()){
+        int s = small.back(); small.pop_back();
+        int l = large.back();
+
+        table[s].prob = scaled[s];
+        table[s].alias = l;
+
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if(scaled[l] < 1.0){
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Leftovers are only off from 1.0 by rounding error
+    for(int i : small) table[i].prob = 1.0;
+    for(int i : large) table[i].prob = 1.0;
+    return table;
+}
+
+// Builds a Walker/Vose alias table over the lights weighted by strength
+// so the shader can pick a light with one random number and two reads
+void Scene::buildLightAliasTable(){
+    std::vector<float> strengths;
+    for(const Light& l : lightsVec) strengths.push_back(l.color_str.a);
+    lightAliasVec = buildAliasTable(strengths);
+}
+
+// Integrates the specular lobe of the shader BRDF over the hemisphere for every view angle and roughness
+// The albedo is F0 * x + y, with the same GGX distribution, shadowing and Schlick Fresnel as eval_brdf
+void Scene::buildBsdfLut(){
+    const int samples = 1024;
+    bsdfLutVec.assign(BSDF_LUT_SIZE * BSDF_LUT_SIZE, glm::vec2(0.0));
+
+    auto G1 = [](float NdotX, float alpha){
+        float cos2 = NdotX * NdotX;
+        return 2.0f / (1.0f + std::sqrt(1.0f + alpha * alpha * (1.0f - cos2) / cos2));
+    };
+
+    for(int y = 0; y < BSDF_LUT_SIZE; y++){
+        float roughness = (y + 0.5f) / BSDF_LUT_SIZE;
+        float alpha = roughness * roughness;
+        float alpha_squared = alpha * alpha;
+
+        for(int x = 0; x < BSDF_LUT_SIZE; x++){
+            float NdotV = (x + 0.5f) / BSDF_LUT_SIZE;
+            glm::vec3 V = glm::vec3(std::sqrt(1.0f - NdotV * NdotV), 0.0f, NdotV);
+            glm::vec2 sum = glm::vec2(0.0);
+
+            // Hammersley points importance sampling the distribution of the half vectors
+            for(int i = 0; i < samples; i++){
+                uint32_t bits = i;
+                bits = (bits << 16u) | (bits >> 16u);
+                bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+                bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+                bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+                bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+                float e1 = (i + 0.5f) / samples;
+                float e2 = float(bits) * 2.3283064365386963e-10f;
+
+                float cos_h = std::sqrt((1.0f - e1) / (1.0f + (alpha_squared - 1.0f) * e1));
+                float sin_h = std::sqrt(1.0f - cos_h * cos_h);
+                float phi = 2.0f * glm::pi<float>() * e2;
+                glm::vec3 H = glm::vec3(sin_h * std::cos(phi), sin_h * std::sin(phi), cos_h);
+                float VdotH = glm::dot(V, H);
+                glm::vec3 L = 2.0f * VdotH * H - V;
+                if(L.z <= 0.0f || VdotH <= 0.0f) continue;
+
+                // BRDF * cos / pdf, with the pdf of L being D * NdotH / (4 * VdotH)
+                float weight = G1(L.z, alpha) * G1(NdotV, alpha) * VdotH / (NdotV * cos_h);
+                float Fc = std::pow(1.0f - VdotH, 5.0f);
+                sum += glm::vec2((1.0f - Fc) * weight, Fc * weight);
+            }
+
+            bsdfLutVec[y * BSDF_LUT_SIZE + x] = sum / float(samples);
+        }
+    }
+}
+
+// The inverse of the matrix with columns e1, e2 and n = cross(e1, e2), its rows are built with cross products
+// Degenerate triangles get a zero transform that no ray can hit
+void Scene::buildTriangleTransforms(){
+    triangleTransformVec.assign(triangleVec.size(), {glm::vec4(0.0), glm::vec4(0.0), glm::vec4(0.0)});
+
+    for(size_t i = 0; i < triangleVec.size(); i++){
+        const Triangle& t = triangleVec[i];
+        glm::vec3 e1 = t.v1 - t.v0;
+        glm::vec3 e2 = t.v2 - t.v0;
+        glm::vec3 n = glm::cross(e1, e2);
+        float det = glm::dot(n, n);
+        if(det <= 0.0f) continue;
+
+        glm::vec3 row0 = glm::cross(e2, n) / det;
+        glm::vec3 row1 = glm::cross(n, e1) / det;
+        glm::vec3 row2 = n / det;
+        triangleTransformVec[i] = {
+            row0: glm::vec4(row0, -glm::dot(row0, t.v0)),
+            row1: glm::vec4(row1, -glm::dot(row1, t.v0)),
+            row2: glm::vec4(row2, -glm::dot(row2, t.v0))
+        };
+    }
+}
+
+// One reference per primitive the traversal tests, by type and in buffer order. Mesh triangles get one each
+void Scene::buildPrimitiveStream(){
+    primitiveRefVec.clear();
+    auto addRefs = [&](PrimitiveTypes type, int count){
+        for(int i = 0; i < count; i++){
+            primitiveRefVec.push_back({uint32_t(type) << 28 | uint32_t(i), 0});
+        }
+    };
+    addRefs(PRIM_SPHERE, total_spheres);
+    addRefs(PRIM_TRIANGLE, total_triangles);
+    addRefs(PRIM_PARALLELOGRAM, total_parallelograms);
+    addRefs(PRIM_DISK, total_disks);
+    addRefs(PRIM_BOX, total_boxes);
+    for(int m = 0; m < total_meshes; m++){
+        uint32_t triangles = (meshVec[m].index_end - meshVec[m].index_start) / 3;
+        for(uint32_t tri = 0; tri < triangles; tri++){
+            primitiveRefVec.push_back({uint32_t(PRIM_MESH) << 28 | uint32_t(m), tri});
+        }
+    }
+    total_primitives = primitiveRefVec.size();
+    buildBvh();
+    // After the BVH so the triangles are laid out in the order its leaves reach them
+    if(DEINDEX_MESHES && !meshesDeindexed) deindexMeshes();
+    buildRayQueryInputs();
+    // Buffers can't be 0 bytes
+    if(total_primitives == 0) primitiveRefVec.push_back({0, 0});
+
+    geometryVec = packGeometry(soaGeometry);
+}
+
+void Scene::primitiveBounds(const PrimitiveRef& ref, glm::vec3& lo, glm::vec3& hi) const{
+    int id = ref.type_id & 0x0fffffff;
+    switch(ref.type_id >> 28){
+        case PRIM_SPHERE:{
+            const Sphere& s = sphereVec[id];
+            lo = s.pos - glm::vec3(s.r);
+            hi = s.pos + glm::vec3(s.r);
+            break;
+        }
+        case PRIM_TRIANGLE:{
+            const Triangle& t = triangleVec[id];
+            lo = glm::min(t.v0, glm::min(t.v1, t.v2));
+            hi = glm::max(t.v0, glm::max(t.v1, t.v2));
+            break;
+        }
+        case PRIM_PARALLELOGRAM:{
+            const Parallelogram& p = parallelogramVec[id];
+            glm::vec3 opposite = p.corner + p.edge1 + p.edge2;
+            lo = glm::min(glm::min(p.corner, opposite), glm::min(p.corner + p.edge1, p.corner + p.edge2));
+            hi = glm::max(glm::max(p.corner, opposite), glm::max(p.corner + p.edge1, p.corner + p.edge2));
+            break;
+        }
+        case PRIM_DISK:{
+            const Disk& d = diskVec[id];
+            lo = d.center - glm::vec3(d.r);
+            hi = d.center + glm::vec3(d.r);
+            break;
+        }
+        case PRIM_BOX:{
+            const Box& b = boxVec[id];
+            glm::vec3 extent = glm::abs(glm::vec3(b.axis_x) * b.axis_x.w) + glm::abs(glm::vec3(b.axis_y) * b.axis_y.w) + glm::abs(glm::vec3(b.axis_z) * b.axis_z.w);
+            lo = b.center - extent;
+            hi = b.center + extent;
+            break;
+        }
+        default:{
+            const MeshInfo& m = meshVec[id];
+            lo = glm::vec3(INFINITY);
+            hi = glm::vec3(-INFINITY);
+            for(uint32_t i = m.index_start + 3 * ref.triangle; i < m.index_start + 3 * ref.triangle + 3; i++){
+                glm::vec3 p = meshVertex(m, meshesDeindexed ? i : indexVec[i]);
+                lo = glm::min(lo, p);
+                hi = glm::max(hi, p);
+            }
+            break;
+        }
+    }
+}
+
+struct BvhItem{
+    PrimitiveRef ref;
+    glm::vec3 lo;
+    glm::vec3 hi;
+    glm::vec3 centroid;
+};
+
+// Appends the subtree over items [begin, end) in depth first order and returns its depth
+// Splits at the median of the centroids along their longest axis
+static int buildBvhNode(std::vector<BvhNode>& nodes, std::vector<BvhItem>& items, int begin, int end){
+    int index = nodes.size();
+    nodes.push_back({});
+
+    glm::vec3 lo(INFINITY), hi(-INFINITY);
+    glm::vec3 centroidLo(INFINITY), centroidHi(-INFINITY);
+    for(int i = begin; i < end; i++){
+        lo = glm::min(lo, items[i].lo);
+        hi = glm::max(hi, items[i].hi);
+        centroidLo = glm::min(centroidLo, items[i].centroid);
+        centroidHi = glm::max(centroidHi, items[i].centroid);
+    }
+
+    int depth = 1;
+    uint32_t prims = 0;
+    if(end - begin <= BVH_MAX_LEAF_SIZE){
+        prims = uint32_t(begin) << 4 | uint32_t(end - begin);
+    }else{
+        glm::vec3 extent = centroidHi - centroidLo;
+        int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+        int mid = (begin + end) / 2;
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+            [axis](const BvhItem& a, const BvhItem& b){ return a.centroid[axis] < b.centroid[axis]; });
+        depth += std::max(buildBvhNode(nodes, items, begin, mid), buildBvhNode(nodes, items, mid, end));
+    }
+
+    // Once the subtree is written the next node is the one a miss continues with
+    nodes[index] = {
+        bounds_min: lo,
+        miss: int(nodes.size()),
+        bounds_max: hi,
+        prims: prims
+    };
+    return depth;
+}
+
+// Threaded BVH over the primitive stream, the references are reordered so every leaf is a contiguous range
+void Scene::buildBvh(){
+    bvhVec.clear();
+    bvhDepth = 0;
+
+    std::vector<BvhItem> items(total_primitives);
+    for(int i = 0; i < total_primitives; i++){
+        items[i].ref = primitiveRefVec[i];
+        primitiveBounds(items[i].ref, items[i].lo, items[i].hi);
+        items[i].centroid = (items[i].lo + items[i].hi) * 0.5f;
+    }
+
+    if(total_primitives > 0){
+        bvhDepth = buildBvhNode(bvhVec, items, 0, total_primitives);
+    }else{
+        // Buffers can't be 0 bytes
+        bvhVec.push_back({glm::vec3(0.0), -1, glm::vec3(0.0), 0});
+    }
+
+    for(BvhNode& node : bvhVec){
+        if(node.miss == int(bvhVec.size())) node.miss = -1;
+    }
+    for(int i = 0; i < total_primitives; i++){
+        primitiveRefVec[i] = items[i].ref;
+    }
+}
+
+// Triangles of the stream become triangle geometry, the rest AABBs the shader intersects itself
+// rayQueryRefVec maps the primitive index of both back to the stream. Must match trace_ray_query() in raytracer.comp
+void Scene::buildRayQueryInputs(){
+    rayQueryVertexVec.clear();
+    rayQueryAabbVec.clear();
+    rayQueryRefVec.clear();
+
+    std::vector<uint32_t> aabbRefs;
+    for(int i = 0; i < total_primitives; i++){
+        const PrimitiveRef& ref = primitiveRefVec[i];
+        int id = ref.type_id & 0x0fffffff;
+        switch(ref.type_id >> 28){
+            case PRIM_TRIANGLE:{
+                const Triangle& t = triangleVec[id];
+                rayQueryVertexVec.insert(rayQueryVertexVec.end(), {t.v0, t.v1, t.v2});
+                rayQueryRefVec.push_back(i);
+                break;
+            }
+            case PRIM_MESH:{
+                const MeshInfo& m = meshVec[id];
+                for(uint32_t v = m.index_start + 3 * ref.triangle; v < m.index_start + 3 * ref.triangle + 3; v++){
+                    rayQueryVertexVec.push_back(meshVertex(m, meshesDeindexed ? v : indexVec[v]));
+                }
+                rayQueryRefVec.push_back(i);
+                break;
+            }
+            default:{
+                Aabb box;
+                primitiveBounds(ref, box.lo, box.hi);
+                rayQueryAabbVec.push_back(box);
+                aabbRefs.push_back(i);
+                break;
+            }
+        }
+    }
+    rayQueryRefVec.insert(rayQueryRefVec.end(), aabbRefs.begin(), aabbRefs.end());
+    // Buffers can't be 0 bytes
+    if(rayQueryRefVec.empty()) rayQueryRefVec.push_back(0);
+}
+
+// Intersection data of the sphere, triangle, parallelogram, disk and box regions, one after the other
+// A region holds fields vec4s per primitive: AoS stores them primitive after primitive, SoA field after field
+// Both layouts have the same size. Must match geometry_field() in raytracer.comp
+std::vector<glm::vec4> Scene::packGeometry(bool soa) const{
+    std::vector<glm::vec4> geometry;
+    auto addRegion = [&](int count, int fields, auto field){
+        size_t start = geometry.size();
+        geometry.resize(start + size_t(count) * fields);
+        for(int i = 0; i < count; i++){
+            for(int f = 0; f < fields; f++){
+                geometry[start + (soa ? size_t(f) * count + i : size_t(i) * fields + f)] = field(i, f);
+            }
+        }
+    };
+
+    // Center and radius
+    addRegion(total_spheres, 1, [&](int i, int f){
+        return glm::vec4(sphereVec[i].pos, sphereVec[i].r);
+    });
+    // Baldwin-Weber rows
+    addRegion(total_triangles, 3, [&](int i, int f){
+        const TriangleTransform& t = triangleTransformVec[i];
+        return f == 0 ? t.row0 : (f == 1 ? t.row1 : t.row2);
+    });
+    // Corner, edges and projector w, the normal is spread over the spare components
+    addRegion(total_parallelograms, 4, [&](int i, int f){
+        const Parallelogram& p = parallelogramVec[i];
+        if(f == 0) return glm::vec4(p.corner, p.normal.x);
+        if(f == 1) return glm::vec4(p.edge1, p.normal.y);
+        if(f == 2) return glm::vec4(p.edge2, p.normal.z);
+        return glm::vec4(p.w, 0.0f);
+    });
+    // Center and radius, normal
+    addRegion(total_disks, 2, [&](int i, int f){
+        const Disk& d = diskVec[i];
+        return f == 0 ? glm::vec4(d.center, d.r) : glm::vec4(d.normal, 0.0f);
+    });
+    // Center, then the axes with their half size
+    addRegion(total_boxes, 4, [&](int i, int f){
+        const Box& b = boxVec[i];
+        if(f == 0) return glm::vec4(b.center, 0.0f);
+        if(f == 1) return b.axis_x;
+        if(f == 2) return b.axis_y;
+        return b.axis_z;
+    });
+
+    // Buffers can't be 0 bytes
+    if(geometry.empty()) geometry.push_back(glm::vec4(0.0));
+    return geometry;
+}
+
+// Replaces the indexed meshes by the corners of their triangles, in the order the BVH leaves reach them
+// Each mesh keeps a contiguous range, its triangles are renumbered and the primitive stream and emitter CDF follow
+void Scene::deindexMeshes(){
+    if(total_meshes == 0) return;
+
+    size_t indexedBytes = vertexVec.size() * sizeof(Vertex) + quantizedVec.size() * sizeof(uint16_t) + indexVec.size() * sizeof(uint32_t);
+
+    // Old triangle numbers of each mesh in leaf order, every triangle has one reference
+    std::vector<std::vector<uint32_t>> order(total_meshes);
+    for(int i = 0; i < total_primitives; i++){
+        PrimitiveRef& ref = primitiveRefVec[i];
+        if((ref.type_id >> 28) != PRIM_MESH) continue;
+        std::vector<uint32_t>& triangles = order[ref.type_id & 0x0fffffff];
+        triangles.push_back(ref.triangle);
+        ref.triangle = triangles.size() - 1;
+    }
+
+    std::vector<Vertex> corners;
+    std::vector<uint16_t> quantizedCorners;
+    // Each mesh keeps its vertex format, its range now counts corners of the buffer of that format
+    for(int m = 0; m < total_meshes; m++){
+        MeshInfo& mi = meshVec[m];
+        uint32_t start = mi.quantized ? quantizedCorners.size() / 3 : corners.size();
+        for(uint32_t tri : order[m]){
+            for(uint32_t i = mi.index_start + 3 * tri; i < mi.index_start + 3 * tri + 3; i++){
+                uint32_t v = indexVec[i];
+                if(mi.quantized){
+                    quantizedCorners.insert(quantizedCorners.end(), quantizedVec.begin() + 3*v, quantizedVec.begin() + 3*v + 3);
+                }else{
+                    corners.push_back(vertexVec[v]);
+                }
+            }
+        }
+        mi.index_end = start + 3 * order[m].size();
+        mi.index_start = start;
+
+        // The area CDF of an emissive mesh is rebuilt over the new triangle order
+        if(mi.light >= 0 && !order[m].empty()){
+            int cdfStart = int(lightsVec[mi.light].pos_angle_aux.y);
+            std::vector<float> pdf;
+            for(uint32_t tri : order[m]){
+                pdf.push_back(meshEmitterCdfVec[cdfStart + tri] - (tri > 0 ? meshEmitterCdfVec[cdfStart + tri - 1] : 0.0f));
+            }
+            float sum = 0.0f;
+            for(int i = 0; i < pdf.size(); i++){
+                sum += pdf[i];
+                meshEmitterCdfVec[cdfStart + i] = sum;
+            }
+            meshEmitterCdfVec[cdfStart + pdf.size() - 1] = 1.0;
+        }
+    }
+    vertexVec = corners;
+    quantizedVec = quantizedCorners;
+    // Buffers can't be 0 bytes
+    indexVec.assign(1, 0);
+    meshesDeindexed = true;
+
+    std::cout<<"Meshes de-indexed: "<<indexedBytes<<" bytes indexed, "
+             <<vertexVec.size() * sizeof(Vertex) + quantizedVec.size() * sizeof(uint16_t)<<" bytes as vertex triples"<<std::endl;
+}
+
+// Position of vertex v of a mesh, dequantized if the mesh stores integers
+glm::vec3 Scene::meshVertex(const MeshInfo& m, uint32_t v) const{
+    if(!m.quantized) return vertexVec[v].pos;
+    glm::vec4 q(quantizedVec[3*v], quantizedVec[3*v+1], quantizedVec[3*v+2], 1.0f);
+    return glm::vec3(glm::dot(m.dequantize[0], q), glm::dot(m.dequantize[1], q), glm::dot(m.dequantize[2], q));
+}
+
 void Scene::addTriangle(Triangle t){
     glm::vec3 edge1 = t.v1 - t.v0;
     glm::vec3 edge2 = t.v2 - t.v0;
     t.normal = glm::normalize(glm::cross(edge1,edge2));
+    t.light = -1;
 
     if(total_triangles == 0) triangleVec.pop_back();
     triangleVec.push_back(t);
@@ -778,10 +1376,25 @@ void Scene::addTriangle(Triangle t){
             color_str: materialVec[t.mat].emission_color,
             type: TRIANGLE 
         });
+        triangleVec.back().light = total_lights-1;
     }
 }
 
+// Quads that are parallelograms become one primitive, the rest are split in two triangles
 void Scene::addQuad(Quad q){
+    glm::vec3 edge1 = q.v1 - q.v0;
+    glm::vec3 edge2 = q.v3 - q.v0;
+    float size = glm::max(glm::length(edge1), glm::length(edge2));
+    if(glm::length(q.v0 + q.v2 - q.v1 - q.v3) <= 1e-4 * size){
+        addParallelogram({
+            corner: q.v0,
+            edge1: edge1,
+            edge2: edge2,
+            mat: q.mat
+        });
+        return;
+    }
+
     addTriangle({
         v0:q.v0,
         v1:q.v1,
@@ -798,22 +1411,93 @@ void Scene::addQuad(Quad q){
 }
 
 
+void Scene::addParallelogram(Parallelogram p){
+    glm::vec3 n = glm::cross(p.edge1, p.edge2);
+    p.normal = glm::normalize(n);
+    p.w = n / glm::dot(n, n);
+    p.light = -1;
+
+    if(total_parallelograms == 0) parallelogramVec.pop_back();
+    parallelogramVec.push_back(p);
+    total_parallelograms = parallelogramVec.size();
+
+    // If it emmits light add it to the list, sampled as a single area light
+    if(materialVec[p.mat].emission_color.a > 0.0){
+        addLight({
+            pos_angle_aux: glm::vec4(total_parallelograms-1,0.0,0.0,0.0),
+            color_str: materialVec[p.mat].emission_color,
+            type: AREA 
+        });
+        parallelogramVec.back().light = total_lights-1;
+    }
+}
+
+// Emissive disks, boxes and planes are not registered as lights, only BSDF sampling finds them
+void Scene::addDisk(Disk d){
+    d.normal = glm::normalize(d.normal);
+
+    if(total_disks == 0) diskVec.pop_back();
+    diskVec.push_back(d);
+    total_disks = diskVec.size();
+}
+
+void Scene::addBox(Box b){
+    b.axis_x = glm::vec4(glm::normalize(glm::vec3(b.axis_x)), b.axis_x.w);
+    b.axis_y = glm::vec4(glm::normalize(glm::vec3(b.axis_y)), b.axis_y.w);
+    b.axis_z = glm::vec4(glm::normalize(glm::vec3(b.axis_z)), b.axis_z.w);
+
+    if(total_boxes == 0) boxVec.pop_back();
+    boxVec.push_back(b);
+    total_boxes = boxVec.size();
+}
+
+void Scene::addPlane(Plane p){
+    float length = glm::length(p.normal);
+    p.normal /= length;
+    p.offset /= length;
+
+    if(total_planes == 0) planeVec.pop_back();
+    planeVec.push_back(p);
+    total_planes = planeVec.size();
+}
+
+// Positions relative to the bounding box of the vertices, 65535 steps per axis
+static void quantizeToBounds(const std::vector<Vertex>& vertices, QuantizedPositions& quantized){
+    glm::vec3 lo(INFINITY);
+    glm::vec3 hi(-INFINITY);
+    for(const Vertex& v : vertices){
+        lo = glm::min(lo, v.pos);
+        hi = glm::max(hi, v.pos);
+    }
+    glm::vec3 step = glm::max(hi - lo, glm::vec3(1e-20f)) / 65535.0f;
+
+    quantized.positions.resize(vertices.size() * 3);
+    for(size_t i = 0; i < vertices.size(); i++){
+        for(int c = 0; c < 3; c++){
+            quantized.positions[3*i + c] = static_cast<uint16_t>(std::round((vertices[i].pos[c] - lo[c]) / step[c]));
+        }
+    }
+    quantized.dequantize = glm::translate(glm::mat4(1.0f), lo) * glm::scale(glm::mat4(1.0f), step);
+}
+
 void Scene::addModel(Model model){
 
     if(total_meshes == 0){
         meshVec.pop_back();
         vertexVec.pop_back();
         indexVec.pop_back();
+        quantizedVec.pop_back();
     }
 
     std::vector<Vertex> vertexVecModel;
     std::vector<uint32_t> indexVecModel;
+    QuantizedPositions quantizedModel;
 
-    if(!LoadModel(ASSETS_DIRECTORY+model.file_name, vertexVecModel, indexVecModel)){
+    if(!LoadModel(ASSETS_DIRECTORY+model.file_name, vertexVecModel, indexVecModel, quantizedModel)){
         std::cerr<<"Error loading model "<<ASSETS_DIRECTORY+model.file_name<<std::endl;
     }else{
         std::cout << "Model "<<ASSETS_DIRECTORY+model.file_name<<" loaded successfully!" << std::endl;
-        std::cout << "Vertex count: " << vertexVecModel.size() << std::endl;
+        std::cout << "Vertex count: " << vertexVecModel.size() + quantizedModel.positions.size() / 3 << std::endl;
         std::cout << "Index count: " << indexVecModel.size() << std::endl;
     }
 
@@ -826,35 +1510,99 @@ void Scene::addModel(Model model){
                                         rotationMatrix *
                                         glm::scale(glm::mat4(1.0f), glm::vec3(model.scale));
 
-    for(int i = 0; i<vertexVecModel.size(); i++){
-        glm::vec4 transformed = transformationMatrix * glm::vec4(vertexVecModel[i].pos, 1.0f);
-        vertexVecModel[i].pos = glm::vec3(transformed);
+    // Quantized positions are never expanded, the model transform goes into the dequantization instead
+    if(!quantizedModel.positions.empty()){
+        quantizedModel.dequantize = transformationMatrix * quantizedModel.dequantize;
+    }else{
+        for(int i = 0; i<vertexVecModel.size(); i++){
+            glm::vec4 transformed = transformationMatrix * glm::vec4(vertexVecModel[i].pos, 1.0f);
+            vertexVecModel[i].pos = glm::vec3(transformed);
+        }
+        if(QUANTIZE_MESHES && !vertexVecModel.empty()){
+            quantizeToBounds(vertexVecModel, quantizedModel);
+            vertexVecModel.clear();
+        }
     }
+    bool quantized = !quantizedModel.positions.empty();
 
-    
     MeshInfo mi = {
         index_start: static_cast<uint>(indexVec.size()),
         index_end: static_cast<uint>(indexVec.size() + indexVecModel.size()),
-        material: model.material
+        material: model.material,
+        light: -1,
+        quantized: quantized ? 1 : 0
     };
+    for(int r = 0; r < 3; r++){
+        const glm::mat4& d = quantizedModel.dequantize;
+        mi.dequantize[r] = glm::vec4(d[0][r], d[1][r], d[2][r], d[3][r]);
+    }
 
-    meshVec.push_back(mi);
-    total_meshes = meshVec.size();
+    // Indices of the model start at its first vertex in the buffer of its format
+    uint32_t vertexBase = quantized ? quantizedVec.size() / 3 : vertexVec.size();
+    for(uint32_t& index : indexVecModel) index += vertexBase;
 
     vertexVec.insert(vertexVec.end(), vertexVecModel.begin(), vertexVecModel.end());
+    quantizedVec.insert(quantizedVec.end(), quantizedModel.positions.begin(), quantizedModel.positions.end());
     indexVec.insert(indexVec.end(), indexVecModel.begin(), indexVecModel.end());
+
+    meshVec.push_back(mi);
+    total_meshes = meshVec.size();
+
+    // An emissive mesh is one light that picks its triangles by area. It only refers to the mesh,
+    // the triangles are read from the vertex buffer when sampled so it follows the mesh transform
+    if(materialVec[model.material].emission_color.a > 0.0 && indexVecModel.size() >= 3){
+        // The placeholder first entry is kept, ranges only start after it
+        int cdfStart = meshEmitterCdfVec.size();
+        int triangles = indexVecModel.size() / 3;
+        double area = 0.0;
+        for(int i = 0; i < triangles; i++){
+            glm::vec3 v0 = meshVertex(mi, indexVecModel[3*i]);
+            glm::vec3 v1 = meshVertex(mi, indexVecModel[3*i+1]);
+            glm::vec3 v2 = meshVertex(mi, indexVecModel[3*i+2]);
+            area += 0.5 * glm::length(glm::cross(v1 - v0, v2 - v0));
+            meshEmitterCdfVec.push_back(area);
+        }
+        for(int i = 0; i < triangles; i++){
+            meshEmitterCdfVec[cdfStart + i] = area > 0.0 ? meshEmitterCdfVec[cdfStart + i] / area : float(i + 1) / triangles;
+        }
+        meshEmitterCdfVec.back() = 1.0;
+
+        addLight({
+            pos_angle_aux: glm::vec4(total_meshes-1, cdfStart, triangles, area),
+            color_str: materialVec[model.material].emission_color,
+            type: MESH 
+        });
+        meshVec.back().light = total_lights-1;
+    }
 }
 
 void Scene::printSceneInfo(){
     std::cout<<"Scene loaded"<<std::endl;
     std::cout<<"Number of spheres: "<<sphereVec.size()<<std::endl;
     std::cout<<"Number of materials: "<<materialVec.size()<<std::endl;
+    std::cout<<"Material memory: "<<packedMaterialVec.size() * sizeof(PackedMaterial)<<" bytes packed, "
+             <<materialVec.size() * sizeof(Material)<<" bytes unpacked"<<std::endl;
     std::cout<<"Number of lights: "<<lightsVec.size()<<std::endl;
     for(auto i: lightsVec){
         printLight(i);
     }
     std::cout<<"Number of triangles: "<<triangleVec.size()<<std::endl;
+    std::cout<<"Triangle intersection data: "<<sizeof(TriangleTransform)<<" bytes per triangle tested, "
+             <<sizeof(Triangle)<<" bytes per triangle stored"<<std::endl;
+    std::cout<<"Number of parallelograms: "<<parallelogramVec.size()<<std::endl;
+    std::cout<<"Number of disks: "<<diskVec.size()<<std::endl;
+    std::cout<<"Number of boxes: "<<boxVec.size()<<std::endl;
+    std::cout<<"Number of planes: "<<planeVec.size()<<std::endl;
+    std::cout<<"Primitive stream: "<<total_primitives<<" references, "
+             <<geometryVec.size() * sizeof(glm::vec4)<<" bytes of "<<(soaGeometry ? "SoA" : "AoS")<<" geometry"<<std::endl;
+    std::cout<<"BVH: "<<bvhVec.size()<<" nodes, depth "<<bvhDepth<<", "<<bvhVec.size() * sizeof(BvhNode)<<" bytes"<<std::endl;
     std::cout<<"Number of models: "<<meshVec.size()<<std::endl;
     std::cout<<"Number of vertices: "<<vertexVec.size()<<std::endl;
     std::cout<<"Number of indices: "<<indexVec.size()<<std::endl;
+    std::cout<<"Number of quantized vertices: "<<quantizedVec.size() / 3<<std::endl;
+    std::cout<<"Mesh memory: "<<vertexVec.size() * sizeof(Vertex)<<" bytes of vertices, "
+             <<quantizedVec.size() * sizeof(uint16_t)<<" bytes of quantized vertices, "
+             <<indexVec.size() * sizeof(uint32_t)<<" bytes of indices"<<std::endl;
+    std::cout<<"Quantization saved "<<quantizedVec.size() / 3 * (sizeof(Vertex) - 3 * sizeof(uint16_t))
+             <<" bytes of vertices"<<std::endl;
 }
\ No newline at end of file
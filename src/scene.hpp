@@ -5,35 +5,103 @@
 
 const std::string ASSETS_DIRECTORY = "assets/";
 
+// Store meshes as vertex triples, one per triangle, instead of indexed vertices
+// Skips the index fetch when tracing at the cost of repeating the shared vertices
+const bool DEINDEX_MESHES = false;
+
+// Store float meshes as 16 bit positions relative to their bounding box, a third of the vertex memory
+// Models imported with KHR_mesh_quantization are always kept quantized
+const bool QUANTIZE_MESHES = false;
+
+// Resolution of the GGX directional albedo table on each axis, must match raytracer.comp
+const int BSDF_LUT_SIZE = 32;
+
+// Lay the geometry buffer out as one array per field (SoA) instead of one record per primitive (AoS)
+// With SoA the neighbouring invocations of a subgroup read neighbouring addresses for the same field
+const bool SOA_GEOMETRY = true;
+
+// Most references in a BVH leaf, at most 15. Smaller leaves make deeper hierarchies
+const int BVH_MAX_LEAF_SIZE = 4;
+
 class Scene{
 public:
     std::vector<Sphere> sphereVec;
     std::vector<Material> materialVec;
+    std::vector<PackedMaterial> packedMaterialVec;  // Shader copy of materialVec, same order
     std::vector<Light> lightsVec;
+    std::vector<LightAlias> lightAliasVec;
     std::vector<Triangle> triangleVec;
+    std::vector<TriangleTransform> triangleTransformVec;   // Intersection data of triangleVec, same order
+    std::vector<PrimitiveRef> primitiveRefVec;  // Spheres, triangles, analytic primitives and mesh triangles, planes are left out
+    std::vector<glm::vec4> geometryVec;         // Intersection data of the primitive stream, see packGeometry()
+    std::vector<BvhNode> bvhVec;                // Hierarchy over primitiveRefVec, which is sorted by its leaves
+    int bvhDepth = 0;
+    // Inputs of the ray query acceleration structures, see buildRayQueryInputs()
+    std::vector<glm::vec3> rayQueryVertexVec;   // World space corners of the triangles and mesh triangles, 3 per triangle
+    std::vector<Aabb> rayQueryAabbVec;          // Bounds of the spheres, parallelograms, disks and boxes
+    std::vector<uint32_t> rayQueryRefVec;       // Stream index of every triangle, then of every AABB
+    bool soaGeometry = SOA_GEOMETRY;
+    std::vector<Parallelogram> parallelogramVec;
+    std::vector<Disk> diskVec;
+    std::vector<Box> boxVec;
+    std::vector<Plane> planeVec;
     std::vector<Vertex> vertexVec;
     std::vector<uint32_t> indexVec;
+    std::vector<uint16_t> quantizedVec;         // xyz of the vertices of quantized meshes, padded to whole uints
+    bool meshesDeindexed = false;               // vertexVec and quantizedVec hold the corners of every triangle in BVH leaf order, indexVec is unused
     std::vector<MeshInfo> meshVec;
+    std::vector<float> meshEmitterCdfVec;       // Area CDF over the triangles of each emissive mesh, one range per mesh
+    std::vector<glm::vec4> environmentVec;      // Equirectangular texels, alpha is the CDF of the texel inside its row
+    std::vector<float> environmentMarginalVec;  // CDF of the rows
+    std::vector<glm::vec2> bsdfLutVec;          // GGX directional albedo as scale and bias of F0, by cos(view) and roughness
     float lights_strength_sum = 0.0;
     int total_lights = 0;
     int total_spheres = 0;
     int total_triangles = 0;
+    int total_parallelograms = 0;
+    int total_disks = 0;
+    int total_boxes = 0;
+    int total_planes = 0;
     int total_meshes = 0;
+    int total_primitives = 0;       // Entries of primitiveRefVec
+    int environment_light = -1;     // Index in the lights list of the environment map, -1 if there is none
+    // Bounds of the geometry, the path guiding grid spans them
+    glm::vec3 boundsMin = glm::vec3(0.0);
+    glm::vec3 boundsMax = glm::vec3(0.0);
     
     Scene();
     void createPreset1();
     void createCornellBox();
+    std::vector<glm::vec4> packGeometry(bool soa) const;
 
 private:
     void addSphere(Sphere s);
     int addMaterial(Material m);
     void addLight(Light l);
+    void buildLightAliasTable();
+    void computeBounds();
+    void buildBsdfLut();
+    void buildTriangleTransforms();
+    void deindexMeshes();
+    void buildPrimitiveStream();
+    void primitiveBounds(const PrimitiveRef& ref, glm::vec3& lo, glm::vec3& hi) const;
+    void buildBvh();
+    void buildRayQueryInputs();
+    glm::vec3 meshVertex(const MeshInfo& m, uint32_t v) const;
     void addTriangle(Triangle t);
     void addQuad(Quad q);
+    void addParallelogram(Parallelogram p);
+    void addDisk(Disk d);
+    void addBox(Box b);
+    void addPlane(Plane p);
     void printLight(const Light& light);
     void addModel(Model model);
+    void addEnvironment(const std::string& file_name, glm::vec3 scale, float strength);
     glm::vec3 calculateNormal(Triangle t);
     void printSceneInfo();
 };
 
+// Walker/Vose alias table over the weights, each entry keeps its normalized weight as pdf
+std::vector<LightAlias> buildAliasTable(const std::vector<float>& weights);
+
 
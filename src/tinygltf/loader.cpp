@@ -1,5 +1,7 @@
 #include "loader.hpp"
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <vector>
 #include <iostream>
 
@@ -9,9 +11,109 @@
 #include "tiny_gltf.h"
 
 
+static glm::mat4 nodeTransform(const tinygltf::Node& node){
+    if (node.matrix.size() == 16) {
+        glm::mat4 m;
+        for (int i = 0; i < 16; ++i) {
+            m[i / 4][i % 4] = static_cast<float>(node.matrix[i]);
+        }
+        return m;
+    }
+
+    glm::mat4 m(1.0f);
+    if (node.translation.size() == 3) {
+        m = glm::translate(m, glm::vec3(node.translation[0], node.translation[1], node.translation[2]));
+    }
+    if (node.rotation.size() == 4) {
+        // glTF stores the quaternion as xyzw
+        m = m * glm::mat4_cast(glm::quat(node.rotation[3], node.rotation[0], node.rotation[1], node.rotation[2]));
+    }
+    if (node.scale.size() == 3) {
+        m = glm::scale(m, glm::vec3(node.scale[0], node.scale[1], node.scale[2]));
+    }
+    return m;
+}
+
+// World transform of the first node that instances mesh 0, identity if none does
+static glm::mat4 meshNodeTransform(const tinygltf::Model& model){
+    std::vector<int> parent(model.nodes.size(), -1);
+    for (size_t i = 0; i < model.nodes.size(); ++i) {
+        for (int child : model.nodes[i].children) {
+            parent[child] = static_cast<int>(i);
+        }
+    }
+
+    for (size_t i = 0; i < model.nodes.size(); ++i) {
+        if (model.nodes[i].mesh != 0) continue;
+        glm::mat4 m(1.0f);
+        for (int n = static_cast<int>(i); n >= 0; n = parent[n]) {
+            m = nodeTransform(model.nodes[n]) * m;
+        }
+        return m;
+    }
+    return glm::mat4(1.0f);
+}
+
+// Integer positions of KHR_mesh_quantization are rebased to uint16 and the rebase is undone by dequantize
+static bool loadQuantizedPositions(const tinygltf::Model& model,
+                                   const tinygltf::Accessor& accessor,
+                                   QuantizedPositions& quantized) {
+    const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
+    const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
+    const unsigned char* data = &buffer.data[bufferView.byteOffset + accessor.byteOffset];
+
+    size_t componentSize;
+    float offset;           // Added to the stored value to make it unsigned
+    float range;            // Value that maps to 1.0 when normalized
+    switch (accessor.componentType) {
+        case TINYGLTF_COMPONENT_TYPE_SHORT:          componentSize = 2; offset = 32768.0f; range = 32767.0f; break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: componentSize = 2; offset = 0.0f;     range = 65535.0f; break;
+        case TINYGLTF_COMPONENT_TYPE_BYTE:           componentSize = 1; offset = 128.0f;   range = 127.0f;   break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:  componentSize = 1; offset = 0.0f;     range = 255.0f;   break;
+        default:
+            std::cerr << "Unsupported POSITION component type" << std::endl;
+            return false;
+    }
+    const size_t stride = bufferView.byteStride != 0 ? bufferView.byteStride : 3 * componentSize;
+
+    quantized.positions.resize(accessor.count * 3);
+    for (size_t i = 0; i < accessor.count; ++i) {
+        const unsigned char* element = data + i * stride;
+        for (int c = 0; c < 3; ++c) {
+            uint16_t u;
+            switch (accessor.componentType) {
+                case TINYGLTF_COMPONENT_TYPE_SHORT: {
+                    int16_t q;
+                    memcpy(&q, element + c * 2, sizeof(q));
+                    u = static_cast<uint16_t>(q + 32768);
+                    break;
+                }
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+                    memcpy(&u, element + c * 2, sizeof(u));
+                    break;
+                case TINYGLTF_COMPONENT_TYPE_BYTE:
+                    u = static_cast<uint16_t>(static_cast<int8_t>(element[c]) + 128);
+                    break;
+                default:
+                    u = element[c];
+                    break;
+            }
+            quantized.positions[i * 3 + c] = u;
+        }
+    }
+
+    // value = (u - offset) / range when normalized, u - offset otherwise
+    float scale = accessor.normalized ? 1.0f / range : 1.0f;
+    glm::mat4 rebase(scale);
+    rebase[3] = glm::vec4(glm::vec3(-offset * scale), 1.0f);
+    quantized.dequantize = meshNodeTransform(model) * rebase;
+    return true;
+}
+
 bool LoadModel(const std::string& filename, 
                std::vector<Vertex>& vertices, 
-               std::vector<uint32_t>& indices) {
+               std::vector<uint32_t>& indices,
+               QuantizedPositions& quantized) {
     tinygltf::Model model;
     tinygltf::TinyGLTF loader;
     std::string err;
@@ -74,6 +176,10 @@ bool LoadModel(const std::string& filename,
     }
     
     const tinygltf::Accessor& posAccessor = model.accessors[posIt->second];
+    if (posAccessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT) {
+        return loadQuantizedPositions(model, posAccessor, quantized);
+    }
+
     const tinygltf::BufferView& posBufferView = model.bufferViews[posAccessor.bufferView];
     const tinygltf::Buffer& posBuffer = model.buffers[posBufferView.buffer];
     
@@ -81,13 +187,16 @@ bool LoadModel(const std::string& filename,
         &posBuffer.data[posBufferView.byteOffset + posAccessor.byteOffset]);
     const size_t vertexCount = posAccessor.count;
 
+    // Same node transform the quantized path folds into dequantize
+    const glm::mat4 node = meshNodeTransform(model);
     vertices.resize(vertexCount);
     for (size_t i = 0; i < vertexCount; ++i) {
-        vertices[i].pos = glm::vec3(
+        vertices[i].pos = glm::vec3(node * glm::vec4(
             posData[i * 3 + 0],
             posData[i * 3 + 1],
-            posData[i * 3 + 2]
-        );
+            posData[i * 3 + 2],
+            1.0f
+        ));
     }
 
     return true;
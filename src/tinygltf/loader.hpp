@@ -3,6 +3,15 @@
 #include "definitions.hpp"
 
 
+// Positions stored with KHR_mesh_quantization, kept as integers instead of expanded to float
+struct QuantizedPositions{
+    std::vector<uint16_t> positions;    // xyz of every vertex, rebased to unsigned
+    glm::mat4 dequantize;               // Maps the integers to model space, includes the transform of the mesh node
+};
+
+// Fills vertices if the positions are float, quantized if they use KHR_mesh_quantization
+// Both include the transform of the node instancing the mesh
 bool LoadModel(const std::string& filename, 
                std::vector<Vertex>& vertices, 
-               std::vector<uint32_t>& indices);
\ No newline at end of file
+               std::vector<uint32_t>& indices,
+               QuantizedPositions& quantized);